@@ -0,0 +1,74 @@
+(**
+  Regression checks for the parts of the Mysql module computed on the
+  client side, run like the other demos: each check prints its name and
+  stops the program when it fails.
+*)
+
+open Printf
+
+let check name ok =
+  printf "%s: %s\n%!" name (if ok then "ok" else "FAILED");
+  assert ok
+
+let close_to a b = abs_float (a -. b) < 1e-9
+
+(* Retry.backoff doubles from base_delay up to max_delay *)
+let () =
+  let b = Mysql.Retry.backoff in
+  check "backoff first" (close_to (b 0) 0.01);
+  check "backoff doubles" (close_to (b 3) 0.08 && close_to (b 6) 0.64);
+  check "backoff capped" (b 7 = 1.0 && b 64 = 1.0 && b 5000 = 1.0);
+  check "backoff delays" (close_to (b ~base_delay:0.5 ~max_delay:10. 2) 2.0
+                          && b ~base_delay:0.5 ~max_delay:10. 5 = 10.)
+
+let db = Mysql.quick_connect ~database:"test" ()
+
+let raises f = match f () with _ -> false | exception Mysql.Error _ -> true
+
+let select cells =
+  Mysql.exec db ("SELECT " ^ String.concat ", " (List.map Mysql.ml2str cells))
+
+(* Block.int takes the whole int range and no more *)
+let () =
+  let past n step = Int64.to_string (Int64.add (Int64.of_int n) step) in
+  let cells = [ string_of_int max_int; string_of_int min_int;
+                past max_int Int64.one; past min_int Int64.minus_one;
+                "-0"; "+7"; "12a" ] in
+  match Mysql.Block.fetch (select cells) 1 with
+  | None -> check "block fetched" false
+  | Some b ->
+    let int = Mysql.Block.int b 0 in
+    check "block max_int" (int 0 = max_int);
+    check "block min_int" (int 1 = min_int);
+    check "block above max_int" (raises (fun () -> int 2));
+    check "block below min_int" (raises (fun () -> int 3));
+    check "block signs" (int 4 = 0 && int 5 = 7);
+    check "block not an int" (raises (fun () -> int 6))
+
+(* the open ranges of Filter go on past the int bounds, as BIGINT does *)
+let () =
+  let module F = Mysql.Filter in
+  let count cells f = F.count (select cells) f in
+  let bounds = [string_of_int min_int; string_of_int max_int; "5"] in
+  check "filter int bounds" (count bounds F.(int_lt 0 min_int ||| int_gt 1 max_int) = 0);
+  check "filter ranges"
+    (count bounds F.(int_lt 0 (min_int + 1) &&& int_gt 1 (max_int - 1) &&& int_eq 2 5) = 1);
+  let bigint = ["-9223372036854775808"; "9223372036854775807"] in
+  check "filter past the int bounds" (count bigint F.(int_lt 0 min_int &&& int_gt 1 max_int) = 1)
+
+(* dml_info reads matched and changed rows from the mysql_info of UPDATE,
+   other statements report their affected rows for both *)
+let () =
+  let dml sql = Mysql.exec_dml db sql in
+  ignore (dml "CREATE TEMPORARY TABLE demo3 (id INT, v INT)");
+  let i = dml "INSERT INTO demo3 VALUES (1, 0), (2, 0), (3, 1)" in
+  check "dml insert" (i.Mysql.affected = 3 && i.Mysql.matched = 3 && i.Mysql.changed = 3);
+  let u = dml "UPDATE demo3 SET v = 1" in
+  check "dml update" (u.Mysql.matched = 3 && u.Mysql.changed = 2 && u.Mysql.affected = 2);
+  let u = dml "UPDATE demo3 SET v = 1 WHERE id > 5" in
+  check "dml update none" (u.Mysql.matched = 0 && u.Mysql.changed = 0);
+  let d = dml "DELETE FROM demo3 WHERE id = 1" in
+  check "dml delete" (d.Mysql.affected = 1 && d.Mysql.matched = 1 && d.Mysql.changed = 1);
+  ignore (dml "DROP TEMPORARY TABLE demo3")
+
+let () = Mysql.disconnect db
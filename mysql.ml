@@ -39,8 +39,8 @@ type result     (* handle to access result from query *)
    without changing the C source code accordingly! *)
 
 (* Error codes *)
-(* Auto-generated on Thu Feb 20 06:10:26 2003 from MySQL headers. *)
-type error_code = Aborting_connection | Access_denied_error | Alter_info | Bad_db_error | Bad_field_error | Bad_host_error | Bad_null_error | Bad_table_error | Blob_cant_have_default | Blob_key_without_length | Blob_used_as_key | Blobs_and_no_terminated | Cant_create_db | Cant_create_file | Cant_create_table | Cant_create_thread | Cant_delete_file | Cant_drop_field_or_key | Cant_find_dl_entry | Cant_find_system_rec | Cant_find_udf | Cant_get_stat | Cant_get_wd | Cant_initialize_udf | Cant_lock | Cant_open_file | Cant_open_library | Cant_read_charset | Cant_read_dir | Cant_remove_all_fields | Cant_reopen_table | Cant_set_wd | Checkread | Columnaccess_denied_error | Commands_out_of_sync | Con_count_error | Conn_host_error | Connection_error | Db_create_exists | Db_drop_delete | Db_drop_exists | Db_drop_rmdir | Dbaccess_denied_error | Delayed_cant_change_lock | Delayed_insert_table_locked | Disk_full | Dup_entry | Dup_fieldname | Dup_key | Dup_keyname | Dup_unique | Empty_query | Error_on_close | Error_on_read | Error_on_rename | Error_on_write | Field_specified_twice | File_exists_error | File_not_found | File_used | Filsort_abort | Forcing_close | Form_not_found | Function_not_defined | Get_errno | Got_signal | Grant_wrong_host_or_user | Handshake_error | Hashchk | Host_is_blocked | Host_not_privileged | Illegal_grant_for_table | Illegal_ha | Insert_info | Insert_table_used | Invalid_default | Invalid_group_func_use | Invalid_use_of_null | Ipsock_error | Key_column_does_not_exits | Key_not_found | Kill_denied_error | Load_info | Localhost_connection | Mix_of_group_func_and_fields | Multiple_pri_key | Namedpipe_connection | Namedpipeopen_error | Namedpipesetstate_error | Namedpipewait_error | Net_error_on_write | Net_fcntl_error | Net_packet_too_large | Net_packets_out_of_order | Net_read_error | Net_read_error_from_pipe | Net_read_interrupted | Net_uncompress_error | Net_write_interrupted | Nisamchk | No | No_db_error | No_raid_compiled | No_such_index | No_such_table | No_such_thread | No_tables_used | No_unique_logfile | Non_uniq_error | Nonexisting_grant | Nonexisting_table_grant | Nonuniq_table | Normal_shutdown | Not_allowed_command | Not_form_file | Not_keyfile | Null_column_in_index | Old_keyfile | Open_as_readonly | Out_of_memory | Out_of_resources | Out_of_sortmemory | Outofmemory | Parse_error | Password_anonymous_user | Password_no_match | Password_not_allowed | Primary_cant_have_null | Ready | Record_file_full | Regexp_error | Requires_primary_key | Server_gone_error | Server_handshake_err | Server_lost | Server_shutdown | Shutdown_complete | Socket_create_error | Stack_overrun | Syntax_error | Table_cant_handle_auto_increment | Table_cant_handle_blob | Table_exists_error | Table_must_have_columns | Table_not_locked | Table_not_locked_for_write | Tableaccess_denied_error | Tcp_connection | Textfile_not_readable | Too_big_fieldlength | Too_big_rowsize | Too_big_select | Too_big_set | Too_long_ident | Too_long_key | Too_long_string | Too_many_delayed_threads | Too_many_fields | Too_many_key_parts | Too_many_keys | Too_many_rows | Too_many_tables | Udf_exists | Udf_no_paths | Unexpected_eof | Unknown_character_set | Unknown_com_error | Unknown_error | Unknown_host | Unknown_procedure | Unknown_table | Unsupported_extension | Update_info | Update_without_key_in_safe_mode | Version_error | Wrong_auto_key | Wrong_column_name | Wrong_db_name | Wrong_field_spec | Wrong_field_terminators | Wrong_field_with_group | Wrong_group_field | Wrong_host_info | Wrong_key_column | Wrong_mrg_table | Wrong_outer_join | Wrong_paramcount_to_procedure | Wrong_parameters_to_procedure | Wrong_sub_key | Wrong_sum_select | Wrong_table_name | Wrong_value_count | Wrong_value_count_on_row | Yes
+(* Auto-generated on Sat Oct 17 18:40:32 2026 from MySQL headers. *)
+type error_code = Aborting_connection | Access_denied_error | Alter_info | Bad_db_error | Bad_field_error | Bad_host_error | Bad_null_error | Bad_table_error | Blob_cant_have_default | Blob_key_without_length | Blob_used_as_key | Blobs_and_no_terminated | Cant_create_db | Cant_create_file | Cant_create_table | Cant_create_thread | Cant_delete_file | Cant_drop_field_or_key | Cant_execute_in_read_only_transaction | Cant_find_dl_entry | Cant_find_system_rec | Cant_find_udf | Cant_get_stat | Cant_get_wd | Cant_initialize_udf | Cant_lock | Cant_open_file | Cant_open_library | Cant_read_charset | Cant_read_dir | Cant_remove_all_fields | Cant_reopen_table | Cant_set_wd | Checkread | Columnaccess_denied_error | Commands_out_of_sync | Con_count_error | Conn_host_error | Connection_error | Db_create_exists | Db_drop_delete | Db_drop_exists | Db_drop_rmdir | Dbaccess_denied_error | Delayed_cant_change_lock | Delayed_insert_table_locked | Disk_full | Dup_entry | Dup_fieldname | Dup_key | Dup_keyname | Dup_unique | Empty_query | Error_during_commit | Error_during_rollback | Error_on_close | Error_on_read | Error_on_rename | Error_on_write | Field_specified_twice | File_exists_error | File_not_found | File_used | Filsort_abort | Forcing_close | Form_not_found | Function_not_defined | Get_errno | Got_signal | Grant_wrong_host_or_user | Handshake_error | Hashchk | Host_is_blocked | Host_not_privileged | Illegal_grant_for_table | Illegal_ha | Insert_info | Insert_table_used | Invalid_default | Invalid_group_func_use | Invalid_use_of_null | Ipsock_error | Key_column_does_not_exits | Key_not_found | Kill_denied_error | Load_info | Localhost_connection | Lock_deadlock | Lock_wait_timeout | Malformed_packet | Mix_of_group_func_and_fields | Multiple_pri_key | Namedpipe_connection | Namedpipeopen_error | Namedpipesetstate_error | Namedpipewait_error | Net_error_on_write | Net_fcntl_error | Net_packet_too_large | Net_packets_out_of_order | Net_read_error | Net_read_error_from_pipe | Net_read_interrupted | Net_uncompress_error | Net_write_interrupted | Nisamchk | No | No_db_error | No_raid_compiled | No_such_index | No_such_table | No_such_thread | No_tables_used | No_unique_logfile | Non_uniq_error | Nonexisting_grant | Nonexisting_table_grant | Nonuniq_table | Normal_shutdown | Not_allowed_command | Not_form_file | Not_keyfile | Null_column_in_index | Old_keyfile | Open_as_readonly | Option_prevents_statement | Out_of_memory | Out_of_resources | Out_of_sortmemory | Outofmemory | Parse_error | Password_anonymous_user | Password_no_match | Password_not_allowed | Primary_cant_have_null | Query_interrupted | Query_timeout | Ready | Record_file_full | Regexp_error | Requires_primary_key | Server_gone_error | Server_handshake_err | Server_lost | Server_lost_extended | Server_shutdown | Shutdown_complete | Socket_create_error | Ssl_connection_error | Stack_overrun | Syntax_error | Table_cant_handle_auto_increment | Table_cant_handle_blob | Table_exists_error | Table_must_have_columns | Table_not_locked | Table_not_locked_for_write | Tableaccess_denied_error | Tcp_connection | Textfile_not_readable | Too_big_fieldlength | Too_big_rowsize | Too_big_select | Too_big_set | Too_long_ident | Too_long_key | Too_long_string | Too_many_concurrent_trxs | Too_many_delayed_threads | Too_many_fields | Too_many_key_parts | Too_many_keys | Too_many_rows | Too_many_tables | Too_many_user_connections | Udf_exists | Udf_no_paths | Unexpected_eof | Unknown_character_set | Unknown_com_error | Unknown_error | Unknown_host | Unknown_procedure | Unknown_table | Unsupported_extension | Update_info | Update_without_key_in_safe_mode | Version_error | Wrong_auto_key | Wrong_column_name | Wrong_db_name | Wrong_field_spec | Wrong_field_terminators | Wrong_field_with_group | Wrong_group_field | Wrong_host_info | Wrong_key_column | Wrong_mrg_table | Wrong_outer_join | Wrong_paramcount_to_procedure | Wrong_parameters_to_procedure | Wrong_sub_key | Wrong_sum_select | Wrong_table_name | Wrong_value_count | Wrong_value_count_on_row | Yes
 
 let error_of_int code = match code with
 | 1000 -> Hashchk
@@ -219,6 +219,16 @@ let error_of_int code = match code with
 | 1173 -> Requires_primary_key
 | 1174 -> No_raid_compiled
 | 1175 -> Update_without_key_in_safe_mode
+| 1180 -> Error_during_commit
+| 1181 -> Error_during_rollback
+| 1203 -> Too_many_user_connections
+| 1205 -> Lock_wait_timeout
+| 1213 -> Lock_deadlock
+| 1290 -> Option_prevents_statement
+| 1317 -> Query_interrupted
+| 1637 -> Too_many_concurrent_trxs
+| 1792 -> Cant_execute_in_read_only_transaction
+| 3024 -> Query_timeout
 | 2000 -> Unknown_error
 | 2001 -> Socket_create_error
 | 2002 -> Connection_error
@@ -240,6 +250,9 @@ let error_of_int code = match code with
 | 2018 -> Namedpipesetstate_error
 | 2019 -> Cant_read_charset
 | 2020 -> Net_packet_too_large
+| 2026 -> Ssl_connection_error
+| 2027 -> Malformed_packet
+| 2055 -> Server_lost_extended
 | _ -> Unknown_error
 
 
@@ -335,7 +348,14 @@ type db_option =
 | SET_CHARSET_DIR of string
 | SET_CHARSET_NAME of string
 | SHARED_MEMORY_BASE_NAME of string
+| OPT_COMPRESSION_ALGORITHMS of string
+| OPT_ZSTD_COMPRESSION_LEVEL of int
+| OPT_MAX_ALLOWED_PACKET of int
+| OPT_NET_BUFFER_LENGTH of int
+| OPT_BIND of string
+| OPT_TCP_KEEPALIVE of int
 | OPT_FOUND_ROWS
+| OPT_SESSION_TRACK
 
 external connect    : db_option list -> db -> dbd                             = "db_connect"
 
@@ -353,13 +373,17 @@ external select_db   : dbd -> string -> unit                = "db_select_db"
 external list_dbs    : dbd -> ?pat:string -> unit -> string array option = "db_list_dbs"
 external disconnect : dbd -> unit                           = "db_disconnect"
 external ping       : dbd -> unit                           = "db_ping"
+external reset      : dbd -> unit                           = "db_reset"
 external exec       : dbd -> string -> result               = "db_exec"
+external exec_spill : ?dir:string -> dbd -> string -> result = "db_exec_spill"
 external real_status     : dbd -> int                         = "db_status"
 external errmsg     : dbd -> string option                  = "db_errmsg"
 external escape     : string -> string                      = "db_escape"
 external real_escape: dbd -> string -> string               = "db_real_escape"
 external set_charset: dbd -> string -> unit                 = "db_set_charset"
+external set_session_vars: dbd -> (string * string) list -> unit = "db_set_session_vars"
 external fetch      : result -> string option array option  = "db_fetch" 
+external fetch_cols : result -> int array -> string option array option = "db_fetch_cols"
 external to_row     : result -> int64 -> unit                 = "db_to_row"
 external size       : result -> int64                         = "db_size"
 external affected    : dbd -> int64                           = "db_affected"
@@ -369,9 +393,89 @@ external client_info : unit -> string = "db_client_info"
 external host_info   : dbd -> string = "db_host_info"
 external server_info : dbd -> string = "db_server_info"
 external proto_info  : dbd -> int    = "db_proto_info"
+external thread_id   : dbd -> int    = "db_thread_id"
+external last_gtids  : dbd -> string option = "db_last_gtids"
+external collect_gtids : dbd -> bool -> string option = "db_collect_gtids"
+external max_row_width : dbd -> int = "db_max_row_width"
+external max_allowed_packet : dbd -> int = "db_max_allowed_packet"
 external fetch_field : result -> field option = "db_fetch_field"
 external fetch_fields : result -> field array option = "db_fetch_fields"
 external fetch_field_dir : result -> int -> field option = "db_fetch_field_dir"
+external autocommit : dbd -> bool -> unit = "db_autocommit"
+external commit     : dbd -> unit = "db_commit"
+external rollback   : dbd -> unit = "db_rollback"
+
+type on_limit = Abort | Spill
+
+(* result limits as passed to the stubs, 0 for none *)
+type limits = {
+  max_rows : int;
+  max_bytes : int;
+  on_limit : on_limit;
+  dir : string option;
+}
+
+external set_limits : dbd -> limits -> unit = "db_set_result_limits"
+external exec_limits : dbd -> string -> limits -> result = "db_exec_limited"
+
+let limits ?(max_rows=0) ?(max_bytes=0) ?(on_limit=Abort) ?dir () =
+  { max_rows; max_bytes; on_limit; dir }
+
+let set_result_limits ?max_rows ?max_bytes ?on_limit ?dir dbd =
+  set_limits dbd (limits ?max_rows ?max_bytes ?on_limit ?dir ())
+
+let exec_limited ?max_rows ?max_bytes ?on_limit ?dir dbd sql =
+  exec_limits dbd sql (limits ?max_rows ?max_bytes ?on_limit ?dir ())
+
+type dml_info = {
+  affected : int;
+  insert_id : int;
+  warnings : int;
+  matched : int;
+  changed : int;
+}
+
+external exec_dml : dbd -> string -> dml_info = "db_exec_dml"
+
+let connect_many ?options ?(parallel=16) ?warmup n db =
+  let conns = Array.make n None in
+  let lock = Mutex.create () in
+  let next = ref 0 and failure = ref None in
+  let rec worker () =
+    Mutex.lock lock;
+    let i = !next in
+    let go = i < n && !failure = None in
+    if go then incr next;
+    Mutex.unlock lock;
+    if go then begin
+      (try
+        let dbd = connect ?options db in
+        conns.(i) <- Some dbd;
+        match warmup with Some f -> f dbd | None -> ()
+      with e ->
+        Mutex.lock lock;
+        if !failure = None then failure := Some e;
+        Mutex.unlock lock);
+      worker ()
+    end
+  in
+  let workers = List.init (max 1 (min parallel n)) (fun _ -> Thread.create worker ()) in
+  List.iter Thread.join workers;
+  match !failure with
+  | Some e ->
+    Array.iter conns ~f:(function Some c -> (try disconnect c with _ -> ()) | None -> ());
+    raise e
+  | None -> Array.map conns ~f:(function Some c -> c | None -> assert false)
+
+let auto_tune dbd =
+  let rec pow2 n k = if k >= n then k else pow2 n (2 * k) in
+  match max_row_width dbd with
+  | 0 -> []
+  | width ->
+    (* the defaults are 1GB and 16KB: only ever suggest raising them *)
+    let packet = min (1 lsl 30) (pow2 (2 * width) (64 * 1024 * 1024)) in
+    (if packet > max_allowed_packet dbd then [OPT_MAX_ALLOWED_PACKET packet] else [])
+    @ [OPT_NET_BUFFER_LENGTH (min (1024 * 1024) (pow2 width (16 * 1024)))]
 
 let status dbd =
   let x = real_status dbd in
@@ -382,6 +486,19 @@ let status dbd =
 
 let errno dbd = error_of_int (real_status dbd)
 
+let start_transaction ?(read_only=false) ?(consistent_snapshot=false) dbd =
+  let opts =
+    (if consistent_snapshot then ["WITH CONSISTENT SNAPSHOT"] else []) @
+    (if read_only then ["READ ONLY"] else [])
+  in
+  ignore (exec dbd ("START TRANSACTION " ^ String.concat ~sep:", " opts))
+
+let transaction ?read_only ?consistent_snapshot dbd f =
+  start_transaction ?read_only ?consistent_snapshot dbd;
+  match let x = f dbd in commit dbd; x with
+  | x -> x
+  | exception e -> (try rollback dbd with _ -> ()); raise e
+
 (* [sub start len str] returns integer obtained from substring of length 
    [len] from [str] *)
 
@@ -600,13 +717,49 @@ let iter res ~f =
     to_row res Int64.zero;
     loop ()
 
+(* positions of the columns [keys]; like [column], a name shared by several
+   columns stands for the last one and an unknown name raises Not_found *)
+let positions res keys =
+  let names = names res in
+  Array.map keys ~f:(fun key ->
+    let rec find i =
+      if i < 0 then raise Not_found
+      else if names.(i) = key then i
+      else find (i - 1)
+    in
+    find (Array.length names - 1))
+
+(* iterate over the projection of the rows on the columns [keys], which are
+   only looked up when there is a row, as [column] did *)
+let iter_proj res keys ~f =
+  if size res > Int64.zero then
+    let cols = positions res keys in
+    let rec loop () =
+      match fetch_cols res cols with
+      | Some row -> f row; loop ()
+      | None -> ()
+    in
+    to_row res Int64.zero;
+    loop ()
+
+let map_proj res keys ~f =
+  if size res > Int64.zero then
+    let cols = positions res keys in
+    let rec loop lst =
+      match fetch_cols res cols with
+      | Some row -> loop (f row :: lst)
+      | None -> lst
+    in
+    to_row res Int64.zero;
+    List.rev (loop [])
+  else
+    []
+
 let iter_col res ~key ~f =
-  let col = column res ~key in
-  iter res ~f:(function row -> f (col ~row))
+  iter_proj res [|key|] ~f:(function row -> f row.(0))
 
 let iter_cols res ~key ~f =
-  let col = column res in
-  iter res ~f:(function row -> f (Array.map key ~f:(function key -> col ~key ~row)))
+  iter_proj res key ~f
 
 let map res ~f =
   if size res > Int64.zero then
@@ -621,12 +774,302 @@ let map res ~f =
     []
 
 let map_col res ~key ~f =
-  let col = column res ~key in
-  map res ~f:(function row -> f (col ~row))
+  map_proj res [|key|] ~f:(function row -> f row.(0))
 
 let map_cols res ~key ~f =
-  let col = column res in
-  map res ~f:(function row -> f (Array.map key ~f:(function key -> col ~key ~row)))
+  map_proj res key ~f
+
+module Cell = struct
+
+external next : result -> bool = "db_next"
+external is_null : result -> int -> bool = "db_cell_is_null"
+external int : result -> int -> int = "db_cell_int"
+external int64 : result -> int -> int64 = "db_cell_int64"
+external float : result -> int -> float = "db_cell_float"
+external string : result -> int -> string = "db_cell_string"
+
+let opt f res i = if is_null res i then None else Some (f res i)
+
+let positions res cols =
+  try positions res cols
+  with Not_found -> raise (Error "Mysql.Cell.positions: unknown column")
+
+let map res ~columns ~f =
+  let pos = positions res columns in
+  let rec loop acc = if next res then loop (f res pos :: acc) else List.rev acc in
+  if size res > Int64.zero then (to_row res Int64.zero; loop []) else []
+
+end
+
+module Row = struct
+
+type _ kind = Int : int kind | Int64 : int64 kind | Float : float kind | String : string kind
+
+type _ t =
+  | Col : 'a kind * string -> 'a t
+  | Null : 'a kind * string -> 'a option t
+  | Pair : 'a t * 'b t -> ('a * 'b) t
+  | Map : 'a t * ('a -> 'b) -> 'b t
+
+let int name = Col (Int, name)
+let int64 name = Col (Int64, name)
+let float name = Col (Float, name)
+let string name = Col (String, name)
+
+let opt : type a. (string -> a t) -> string -> a option t = fun f name ->
+  match f name with
+  | Col (kind, name) -> Null (kind, name)
+  | Null _ | Pair _ | Map _ -> invalid_arg "Mysql.Row.opt"
+
+let ( @ ) a b = Pair (a, b)
+let map f spec = Map (spec, f)
+
+(* a specification with its columns resolved, walked by db_decode_rows:
+   the C code relies on the order of the constructors, and on that of the
+   kinds for the cells *)
+type _ plan =
+  | Cell : 'a kind * int -> 'a plan
+  | Cell_null : 'a kind * int -> 'a option plan
+  | Both : 'a plan * 'b plan -> ('a * 'b) plan
+  | Apply : 'a plan * ('a -> 'b) -> 'b plan
+
+external decode_rows : result -> 'a plan -> int -> 'a array = "db_decode_rows"
+
+type 'a decoder = { res : result; plan : 'a plan }
+
+let decoder res spec =
+  let rec columns : type a. a t -> string list -> string list = fun spec acc ->
+    match spec with
+    | Col (_, name) -> name :: acc
+    | Null (_, name) -> name :: acc
+    | Pair (a, b) -> columns b (columns a acc)
+    | Map (spec, _) -> columns spec acc
+  in
+  let pos = Cell.positions res (Array.of_list (List.rev (columns spec []))) in
+  let rec plan : type a. a t -> int -> int * a plan = fun spec k ->
+    match spec with
+    | Col (kind, _) -> k + 1, Cell (kind, pos.(k))
+    | Null (kind, _) -> k + 1, Cell_null (kind, pos.(k))
+    | Pair (a, b) ->
+      let k, pa = plan a k in
+      let k, pb = plan b k in
+      k, Both (pa, pb)
+    | Map (spec, f) ->
+      let k, p = plan spec k in
+      k, Apply (p, f)
+  in
+  { res = res; plan = snd (plan spec 0) }
+
+let fetch d n = decode_rows d.res d.plan n
+
+let decode ?(batch=256) res spec =
+  if size res > Int64.zero then begin
+    to_row res Int64.zero;
+    let d = decoder res spec in
+    let rec loop acc =
+      match fetch d batch with
+      | [||] -> List.rev acc
+      | rows -> loop (Array.fold_left rows ~init:acc ~f:(fun acc row -> row :: acc))
+    in
+    loop []
+  end
+  else []
+
+end
+
+module Block = struct
+
+type t = {
+  mutable data : Bytes.t; (* bytes of all the cells *)
+  mutable cells : int array; (* offset, length per cell, length -1 for NULL *)
+  mutable rows : int;
+  mutable cols : int;
+}
+
+external fill : result -> t -> int -> int array option -> bool = "db_fetch_block"
+
+let fill ?cols res b n = fill res b n cols
+
+let create () = { data = Bytes.empty; cells = [||]; rows = 0; cols = 0 }
+
+let fetch ?cols res n =
+  let b = create () in
+  if fill ?cols res b n then Some b else None
+
+let rows b = b.rows
+let cols b = b.cols
+
+let index b row col =
+  if row < 0 || row >= b.rows || col < 0 || col >= b.cols then invalid_arg "Mysql.Block: out of range";
+  2 * (row * b.cols + col)
+
+let data b = b.data
+let offset b row col = b.cells.(index b row col)
+let length b row col = max 0 b.cells.(index b row col + 1)
+let is_null b row col = b.cells.(index b row col + 1) < 0
+
+let get b row col =
+  let i = index b row col in
+  if b.cells.(i + 1) < 0 then None
+  else Some (Bytes.sub_string b.data b.cells.(i) b.cells.(i + 1))
+
+(* parsed in place, the cell is not copied *)
+let int b row col =
+  let i = index b row col in
+  let off = b.cells.(i) and len = b.cells.(i + 1) in
+  if len < 0 then raise (Error "Mysql.Block.int: NULL");
+  let bad () = raise (Error "Mysql.Block.int: not an integer") in
+  let neg = len > 0 && Bytes.get b.data off = '-' in
+  let start = if len > 0 && (neg || Bytes.get b.data off = '+') then 1 else 0 in
+  if start = len then bad ();
+  let range () = raise (Error "Mysql.Block.int: does not fit in an int") in
+  let rec loop k acc =
+    if k = len then acc
+    else match Bytes.get b.data (off + k) with
+      | '0'..'9' as c ->
+        let d = Char.code c - 48 in
+        (* 10 * acc - d >= min_int, the division rounding towards zero *)
+        if acc < (min_int + d) / 10 then range ();
+        loop (k + 1) (10 * acc - d)
+      | _ -> bad ()
+  in
+  let n = loop start 0 in (* accumulated negatively to reach min_int *)
+  if neg then n else if n = min_int then range () else -n
+
+let iter ?(batch=256) ?cols res ~f =
+  if size res > Int64.zero then begin
+    let b = create () in
+    to_row res Int64.zero;
+    while fill ?cols res b batch do
+      for row = 0 to b.rows - 1 do f b row done
+    done
+  end
+
+end
+
+type row_buffer = Block.t
+
+let row_buffer () = Block.create ()
+
+let fetch_into ?cols res buf = Block.fill ?cols res buf 1
+
+module Filter = struct
+
+(* the tags are those of db_fetch_matching *)
+type t =
+  | Eq of int * string
+  | Prefix of int * string
+  | Range of int * string * string
+  | Int_range of int * int * int
+  | Int_above of int * int
+  | Int_below of int * int
+  | Null of int
+  | And of t * t
+  | Or of t * t
+  | Not of t
+
+let eq col v = Eq (col, v)
+let prefix col v = Prefix (col, v)
+let between col lo hi = Range (col, lo, hi)
+let int_eq col n = Int_range (col, n, n)
+let int_between col lo hi = Int_range (col, lo, hi)
+let int_lt col n = Int_below (col, n)
+let int_gt col n = Int_above (col, n)
+let is_null col = Null col
+let ( &&& ) a b = And (a, b)
+let ( ||| ) a b = Or (a, b)
+let not_ f = Not f
+
+external fetch : result -> t -> int array option -> string option array option = "db_fetch_matching"
+external count_from : result -> t -> int = "db_count_matching"
+
+let fetch ?cols res f = fetch res f cols
+
+let count res f =
+  if size res > Int64.zero then (to_row res Int64.zero; count_from res f) else 0
+
+let iter ?cols res f ~f:g =
+  if size res > Int64.zero then begin
+    to_row res Int64.zero;
+    let rec loop () =
+      match fetch ?cols res f with
+      | Some row -> g row; loop ()
+      | None -> ()
+    in
+    loop ()
+  end
+
+let map ?cols res f ~f:g =
+  let acc = ref [] in
+  iter ?cols res f ~f:(fun row -> acc := g row :: !acc);
+  List.rev !acc
+
+end
+
+module Index = struct
+
+type handle
+
+type t = {
+  res : result; (* holds the rows *)
+  handle : handle;
+}
+
+external index_create : result -> int array -> handle = "db_index_create"
+external index_lookup : result -> handle -> string array -> int array option -> string option array option
+  = "db_index_lookup"
+
+let create res columns = { res = res; handle = index_create res (Cell.positions res columns) }
+
+let find ?cols ix keys = index_lookup ix.res ix.handle keys cols
+
+let lookup ?cols ix key = index_lookup ix.res ix.handle [|key|] cols
+
+end
+
+module Parallel = struct
+
+type index
+
+external row_index : result -> index = "db_row_index"
+external decode_slice : result -> index -> 'a Row.plan -> int -> int -> 'a array = "db_decode_slice"
+
+type 'a outcome = Done of 'a | Failed of exn
+
+(* decode the rows of [res] in chunks spread over [domains] domains, each
+   domain applying [f] to the chunks of its own contiguous range. Domains come
+   from Mysql_parallel, which runs the parts one after the other before OCaml 5. *)
+let run ?(domains = Mysql_parallel.recommended_domain_count ()) ?(chunk = 4096) res spec ~f =
+  let d = Row.decoder res spec in
+  let ix = row_index res in
+  let n = Int64.to_int (size res) in
+  let parts = max 1 (min domains (n / chunk + 1)) in
+  let work i () =
+    let hi = (i + 1) * n / parts in
+    let rec loop lo acc =
+      if lo >= hi then List.rev acc
+      else
+        let next = min hi (lo + chunk) in
+        let rows = decode_slice res ix d.Row.plan lo next in
+        loop next (f lo rows :: acc)
+    in
+    loop (i * n / parts) []
+  in
+  let spawned = List.init (parts - 1) (fun i -> Mysql_parallel.spawn (work (i + 1))) in
+  let mine = match work 0 () with r -> Done r | exception e -> Failed e in
+  let others =
+    List.map (fun d -> match Mysql_parallel.join d with r -> Done r | exception e -> Failed e) spawned
+  in
+  List.map (function Done r -> r | Failed e -> raise e) (mine :: others)
+
+let iter ?domains ?chunk res spec ~f =
+  ignore (run ?domains ?chunk res spec ~f)
+
+let map ?domains ?chunk res spec ~f =
+  let chunks = run ?domains ?chunk res spec ~f:(fun _ rows -> Array.map rows ~f) in
+  Array.concat (List.concat chunks)
+
+end
 
 module Prepared = struct
 
@@ -636,11 +1079,1291 @@ type stmt_result
 external create : dbd -> string -> stmt = "caml_mysql_stmt_prepare"
 external execute : stmt -> string array -> stmt_result = "caml_mysql_stmt_execute"
 external execute_null : stmt -> string option array -> stmt_result = "caml_mysql_stmt_execute_null"
+(* parameters bound as strings (0), signed (1) or unsigned (2) integers *)
+external execute_typed : stmt -> string array -> int array -> stmt_result = "caml_mysql_stmt_execute_typed"
+external execute_dml : stmt -> string array -> dml_info = "caml_mysql_stmt_execute_dml"
+external execute_dml_null : stmt -> string option array -> dml_info = "caml_mysql_stmt_execute_dml_null"
 external affected : stmt -> int64 = "caml_mysql_stmt_affected"
 external insert_id : stmt -> int64 = "caml_mysql_stmt_insert_id"
 external real_status : stmt -> int = "caml_mysql_stmt_status"
 external fetch : stmt_result -> string option array option = "caml_mysql_stmt_fetch"
+external fetch_into : stmt_result -> row_buffer -> int array option -> bool = "caml_mysql_stmt_fetch_into"
 external result_metadata : stmt -> result = "caml_mysql_stmt_result_metadata"
 external close : stmt -> unit = "caml_mysql_stmt_close"
 
+let fetch_into ?cols r buf = fetch_into r buf cols
+
+end
+
+module Scan = struct
+
+type 'a outcome = Done of 'a | Failed of exn
+
+(* [kinds] tells how each key is bound, see [Prepared.execute_typed] *)
+type cursor = { stmt : Prepared.stmt; positions : int array; kinds : int array }
+
+(* the statement for the pages after the first and the page being prefetched *)
+type state = {
+  mutable next : cursor option;
+  mutable pending : Thread.t option;
+  mutable closed : bool;
+}
+
+let select_sql ~table ~columns ~key ~limit ~after =
+  let keys = String.concat ~sep:"," (Array.to_list key) in
+  let where =
+    if after then
+      Printf.sprintf " WHERE (%s) > (%s)" keys
+        (String.concat ~sep:"," (Array.to_list (Array.map key ~f:(fun _ -> "?"))))
+    else
+      ""
+  in
+  Printf.sprintf "SELECT %s FROM %s%s ORDER BY %s LIMIT %d"
+    (String.concat ~sep:"," (Array.to_list columns)) table where keys limit
+
+(* integer keys are bound as integers: as strings they would be compared as
+   doubles and lose precision above 2^53 *)
+let kind field =
+  match field.ty with
+  | IntTy | Int64Ty -> if field.flags land 32 <> 0 (* UNSIGNED_FLAG *) then 2 else 1
+  | _ -> 0
+
+(* prepare [sql] and locate the key columns in its select list *)
+let cursor dbd sql key =
+  let stmt = Prepared.create dbd sql in
+  let fields =
+    match fetch_fields (Prepared.result_metadata stmt) with
+    | Some f -> f
+    | None -> [||]
+  in
+  let position k =
+    let k' = String.lowercase_ascii k in
+    let rec find i =
+      if i = Array.length fields then begin
+        Prepared.close stmt;
+        raise (Error ("Mysql.Scan: key column " ^ k ^ " is not in the select list"))
+      end
+      else if String.lowercase_ascii fields.(i).name = k' then i
+      else find (i + 1)
+    in
+    find 0
+  in
+  let positions = Array.map key ~f:position in
+  { stmt = stmt; positions = positions;
+    kinds = Array.map positions ~f:(fun i -> kind fields.(i)) }
+
+(* execute [c] and read the whole page, returning its rows and the key of
+   the last row if the page was full (i.e. there may be more) *)
+let load c ~limit params =
+  let res = Prepared.execute_typed c.stmt params
+      (if Array.length params = 0 then [||] else c.kinds) in
+  let rec loop acc =
+    match Prepared.fetch res with
+    | Some row -> loop (row :: acc)
+    | None -> acc
+  in
+  let rows = Array.of_list (List.rev (loop [])) in
+  let err = Prepared.real_status c.stmt in
+  if err <> 0 then
+    raise (Error (Printf.sprintf "Mysql.Scan: fetch failed with error %d" err));
+  let n = Array.length rows in
+  if n < limit then
+    (rows, None)
+  else
+    let key = Array.map c.positions ~f:(fun i ->
+      match rows.(n - 1).(i) with
+      | Some v -> v
+      | None -> raise (Error "Mysql.Scan: NULL value in key column"))
+    in
+    (rows, Some key)
+
+(* wait for the prefetch and close the statement; later pages raise *)
+let release st =
+  if not st.closed then begin
+    st.closed <- true;
+    (match st.pending with Some t -> Thread.join t | None -> ());
+    st.pending <- None;
+    (match st.next with Some c -> Prepared.close c.stmt | None -> ());
+    st.next <- None
+  end
+
+let scan ?(columns = [|"*"|]) ?(page_size = 1000) ?(prefetch = true) ?after dbd ~table ~key =
+  if Array.length key = 0 then invalid_arg "Mysql.Scan.rows: empty key";
+  if page_size < 1 then invalid_arg "Mysql.Scan.rows: page_size";
+  let st = { next = None; pending = None; closed = false } in
+  let sql after = select_sql ~table ~columns ~key ~limit:page_size ~after in
+  (* pages are loaded one after the other, never concurrently *)
+  let next () =
+    if st.closed then raise (Error "Mysql.Scan: scan is closed");
+    match st.next with
+    | Some c -> c
+    | None -> let c = cursor dbd (sql true) key in st.next <- Some c; c
+  in
+  (* run [f] in a separate thread, the result is available through the lazy value *)
+  let start f =
+    if prefetch then begin
+      let r = ref (Failed Not_found) in
+      let t = Thread.create (fun () -> r := (try Done (f ()) with e -> Failed e)) () in
+      st.pending <- Some t;
+      lazy (Thread.join t; st.pending <- None; match !r with Done v -> v | Failed e -> raise e)
+    end
+    else lazy (f ())
+  in
+  let first () =
+    match after with
+    | Some k -> load (next ()) ~limit:page_size k
+    | None ->
+      let c = cursor dbd (sql false) key in
+      let page = try load c ~limit:page_size [||] with e -> Prepared.close c.stmt; raise e in
+      Prepared.close c.stmt;
+      page
+  in
+  (* the next page is requested as soon as the current one is handed out *)
+  let rec deliver (rows, last) =
+    let tail =
+      match last with
+      | None -> release st; lazy Seq.Nil
+      | Some k ->
+        let page = start (fun () -> load (next ()) ~limit:page_size k) in
+        lazy (deliver (Lazy.force page) ())
+    in
+    let rec from i () =
+      if i < Array.length rows then Seq.Cons (rows.(i), from (i + 1))
+      else Lazy.force tail
+    in
+    from 0
+  in
+  let head = lazy (deliver (first ())) in
+  st, (fun () -> Lazy.force head ())
+
+let rows ?columns ?page_size ?prefetch ?after dbd ~table ~key =
+  snd (scan ?columns ?page_size ?prefetch ?after dbd ~table ~key)
+
+let with_rows ?columns ?page_size ?prefetch ?after dbd ~table ~key ~f =
+  let st, rows = scan ?columns ?page_size ?prefetch ?after dbd ~table ~key in
+  match f rows with
+  | v -> release st; v
+  | exception e -> (try release st with _ -> ()); raise e
+
+end
+
+(* A condition variable with a timeout for a single waiting thread: a
+   self-pipe the waiter selects on. Wakeups are not lost because the pipe
+   keeps the byte until the waiter drains it; callers recheck their
+   condition afterwards as with [Condition.wait]. *)
+module Alarm = struct
+
+type t = { rd : Unix.file_descr; wr : Unix.file_descr }
+
+let create () =
+  let rd, wr = Unix.pipe () in
+  Unix.set_nonblock rd;
+  Unix.set_nonblock wr;
+  { rd = rd; wr = wr }
+
+let wake t =
+  try ignore (Unix.single_write t.wr (Bytes.make 1 '!') 0 1)
+  with Unix.Unix_error _ -> () (* pipe full: a wakeup is already pending *)
+
+(* [wait t m timeout] releases [m] until [wake t] or [timeout] seconds
+   (forever if negative) *)
+let wait t m timeout =
+  Mutex.unlock m;
+  (try ignore (Unix.select [t.rd] [] [] timeout)
+   with Unix.Unix_error (Unix.EINTR, _, _) -> ());
+  let buf = Bytes.create 64 in
+  (try while Unix.read t.rd buf 0 64 > 0 do () done
+   with Unix.Unix_error _ -> ());
+  Mutex.lock m
+
+let close t = Unix.close t.rd; Unix.close t.wr
+
+end
+
+module Group_commit = struct
+
+type state = Pending | Committed | Failed of exn
+
+type item = { sql : string; mutable state : state }
+
+type t = {
+  dbd : dbd;
+  interval : float;
+  max_batch : int;
+  lock : Mutex.t;
+  arrived : Alarm.t; (* first statement of a batch, full batch or shutdown *)
+  finished : Condition.t; (* some statements were committed or failed *)
+  queue : item Queue.t;
+  mutable closed : bool;
+  mutable flusher : Thread.t option;
+}
+
+let pending i = match i.state with Pending -> true | Committed | Failed _ -> false
+
+(* with [t.lock] held: wait for the first statement, give others [t.interval]
+   seconds to join, then take up to [t.max_batch] of them *)
+let take t =
+  while Queue.is_empty t.queue && not t.closed do Alarm.wait t.arrived t.lock (-1.) done;
+  let deadline = Unix.gettimeofday () +. t.interval in
+  let rec linger () =
+    let left = deadline -. Unix.gettimeofday () in
+    if left > 0. && Queue.length t.queue < t.max_batch && not t.closed then begin
+      Alarm.wait t.arrived t.lock left;
+      linger ()
+    end
+  in
+  linger ();
+  let rec pop acc n =
+    if n = 0 || Queue.is_empty t.queue then List.rev acc
+    else pop (Queue.pop t.queue :: acc) (n - 1)
+  in
+  pop [] t.max_batch
+
+(* run [batch] in one transaction; returns the outcome of every settled
+   statement and the statements to be retried in the next batch *)
+let run t batch =
+  let rec go = function
+    | [] -> None
+    | i :: rest ->
+      match exec t.dbd i.sql with
+      | _ -> go rest
+      | exception e -> Some (i, e)
+  in
+  match go batch with
+  | None ->
+    begin match commit t.dbd with
+    | () -> List.map (fun i -> (i, Committed)) batch, []
+    | exception e ->
+      (try rollback t.dbd with _ -> ());
+      List.map (fun i -> (i, Failed e)) batch, []
+    end
+  | Some (bad, e) ->
+    (try rollback t.dbd with _ -> ());
+    [(bad, Failed e)], List.filter (fun i -> i != bad) batch
+
+let rec flush t =
+  Mutex.lock t.lock;
+  let batch = take t in
+  Mutex.unlock t.lock;
+  match batch with
+  | [] -> ()
+  | _ ->
+    let settled, retry = run t batch in
+    Mutex.lock t.lock;
+    List.iter (fun (i, st) -> i.state <- st) settled;
+    let q = Queue.create () in
+    List.iter (fun i -> Queue.push i q) retry;
+    Queue.transfer t.queue q;
+    Queue.transfer q t.queue;
+    Condition.broadcast t.finished;
+    Mutex.unlock t.lock;
+    flush t
+
+let create ?(interval=0.005) ?(max_batch=100) dbd =
+  if max_batch < 1 then invalid_arg "Mysql.Group_commit.create: max_batch";
+  autocommit dbd false;
+  let t = { dbd = dbd; interval = interval; max_batch = max_batch;
+            lock = Mutex.create (); arrived = Alarm.create (); finished = Condition.create ();
+            queue = Queue.create (); closed = false; flusher = None } in
+  t.flusher <- Some (Thread.create flush t);
+  t
+
+let exec t sql =
+  let i = { sql = sql; state = Pending } in
+  Mutex.lock t.lock;
+  if t.closed then begin
+    Mutex.unlock t.lock;
+    raise (Error "Mysql.Group_commit.exec: writer is closed")
+  end;
+  Queue.push i t.queue;
+  let n = Queue.length t.queue in
+  if n = 1 || n = t.max_batch then Alarm.wake t.arrived;
+  while pending i do Condition.wait t.finished t.lock done;
+  Mutex.unlock t.lock;
+  match i.state with
+  | Failed e -> raise e
+  | Pending | Committed -> ()
+
+let close t =
+  Mutex.lock t.lock;
+  t.closed <- true;
+  Alarm.wake t.arrived;
+  Mutex.unlock t.lock;
+  (match t.flusher with Some th -> Thread.join th; Alarm.close t.arrived | None -> ());
+  t.flusher <- None;
+  autocommit t.dbd true
+
+end
+
+module Retry = struct
+
+let retryable = function
+  | Lock_deadlock | Lock_wait_timeout
+  | Server_gone_error | Server_lost | Server_lost_extended -> true
+  | _ -> false
+
+let lost_connection = function
+  | Server_gone_error | Server_lost | Server_lost_extended -> true
+  | _ -> false
+
+(* the error [e] stands for. Errors of prepared statements are kept on the
+   statement rather than the connection, so [errno dbd] is only trusted when
+   the connection reports the same message; otherwise the server's message
+   is recognised. *)
+let classify dbd e =
+  match e with
+  | Error msg when errmsg dbd = Some msg -> errno dbd
+  | Error msg ->
+    let contains sub =
+      let n = String.length msg and k = String.length sub in
+      let rec at i = i + k <= n && (String.sub msg ~pos:i ~len:k = sub || at (i + 1)) in
+      at 0
+    in
+    if contains "Deadlock found" then Lock_deadlock
+    else if contains "Lock wait timeout exceeded" then Lock_wait_timeout
+    else if contains "server has gone away" then Server_gone_error
+    else if contains "Lost connection to" then Server_lost
+    else Unknown_error
+  | _ -> Unknown_error
+
+let backoff ?(base_delay=0.01) ?(max_delay=1.0) n =
+  min max_delay (base_delay *. 2. ** float_of_int n)
+
+let random = lazy (Random.State.make_self_init ())
+
+let transaction ?(attempts=10) ?(base_delay=0.01) ?(max_delay=1.0) ?(timeout=30.0)
+    ?read_only ?consistent_snapshot dbd f =
+  let deadline = Unix.gettimeofday () +. timeout in
+  let rec attempt n =
+    match
+      start_transaction ?read_only ?consistent_snapshot dbd;
+      let x = f dbd in
+      commit dbd;
+      x
+    with
+    | x -> x
+    | exception (Error _ as e) ->
+      (* classify the error before rollback resets it *)
+      let code = classify dbd e in
+      (try rollback dbd with _ -> ());
+      let delay = Random.State.float (Lazy.force random) (backoff ~base_delay ~max_delay n) in
+      if n + 1 >= attempts || not (retryable code)
+         || Unix.gettimeofday () +. delay > deadline then raise e;
+      Thread.delay delay;
+      (* with OPT_RECONNECT ping re-establishes the connection, otherwise it fails *)
+      if lost_connection code then (try ping dbd with _ -> raise e);
+      attempt (n + 1)
+    | exception e -> (try rollback dbd with _ -> ()); raise e
+  in
+  attempt 0
+
+end
+
+(* A statement that may be cancelled with KILL QUERY from another connection,
+   shared by Watchdog and Router. The killer sets [Killing] before sending the
+   KILL and [Killed] once it is done. *)
+module Killable = struct
+
+type state = Running | Killing | Killed | Finished
+
+type t = { mutable thread : int; (* server thread id, -1 until known *) mutable state : state }
+
+let create thread = { thread = thread; state = Running }
+
+(* with [m] held: wait for a KILL in progress, then mark the statement
+   finished; whether it was killed *)
+let finish k m changed =
+  while k.state = Killing do Condition.wait changed m done;
+  let killed = k.state = Killed in
+  k.state <- Finished;
+  killed
+
+(* the statement completed just before being killed: make sure the pending
+   KILL QUERY hits a no-op rather than the next statement *)
+let settle dbd ~killed = if killed then (try ignore (exec dbd "DO 0") with _ -> ())
+
+end
+
+module Watchdog = struct
+
+type 'a outcome = Done of 'a | Failed of exn
+
+type call = { query : Killable.t; deadline : float }
+
+type t = {
+  db : db;
+  options : db_option list;
+  pool_size : int;
+  lock : Mutex.t;
+  changed : Condition.t; (* some calls were killed *)
+  wakeup : Alarm.t; (* for the watcher: new earliest deadline or shutdown *)
+  mutable calls : call list; (* running calls, watched for their deadline *)
+  mutable idle : dbd list; (* control connections *)
+  mutable closed : bool;
+  mutable watcher : Thread.t option;
+}
+
+let release t c =
+  Mutex.lock t.lock;
+  let keep = not t.closed && List.length t.idle < t.pool_size in
+  if keep then t.idle <- c :: t.idle;
+  Mutex.unlock t.lock;
+  if not keep then (try disconnect c with _ -> ())
+
+(* cancel the statement running in [call] from a control connection *)
+let kill t call =
+  Mutex.lock t.lock;
+  let c = match t.idle with c :: rest -> t.idle <- rest; Some c | [] -> None in
+  Mutex.unlock t.lock;
+  match (match c with Some c -> c | None -> connect ~options:t.options t.db) with
+  | exception _ -> ()
+  | c ->
+    match exec c (Printf.sprintf "KILL QUERY %d" call.query.Killable.thread) with
+    | _ -> release t c
+    | exception _ -> (try disconnect c with _ -> ())
+
+let watch t =
+  Mutex.lock t.lock;
+  while not t.closed do
+    let now = Unix.gettimeofday () in
+    match List.partition (fun c -> c.deadline <= now) t.calls with
+    | [], [] -> Alarm.wait t.wakeup t.lock (-1.)
+    | [], c :: rest ->
+      let next = List.fold_left (fun d c -> min d c.deadline) c.deadline rest in
+      Alarm.wait t.wakeup t.lock (next -. now)
+    | due, running ->
+      t.calls <- running;
+      List.iter (fun c -> c.query.Killable.state <- Killable.Killing) due;
+      Mutex.unlock t.lock;
+      List.iter (kill t) due;
+      Mutex.lock t.lock;
+      List.iter (fun c -> c.query.Killable.state <- Killable.Killed) due;
+      Condition.broadcast t.changed
+  done;
+  Mutex.unlock t.lock
+
+let create ?(options=[]) ?(pool_size=2) db =
+  let t = { db = db; options = options; pool_size = pool_size;
+            lock = Mutex.create (); changed = Condition.create (); wakeup = Alarm.create ();
+            calls = []; idle = []; closed = false; watcher = None } in
+  t.watcher <- Some (Thread.create watch t);
+  t
+
+let earliest call calls = List.for_all (fun c -> c == call || call.deadline <= c.deadline) calls
+
+let guard t ~timeout dbd f =
+  let call = { query = Killable.create (thread_id dbd); deadline = Unix.gettimeofday () +. timeout } in
+  Mutex.lock t.lock;
+  if t.closed then begin
+    Mutex.unlock t.lock;
+    raise (Error "Mysql.Watchdog: watchdog is closed")
+  end;
+  t.calls <- call :: t.calls;
+  (* the watcher sleeps until the earliest deadline *)
+  if earliest call t.calls then Alarm.wake t.wakeup;
+  Mutex.unlock t.lock;
+  let outcome = try Done (f ()) with e -> Failed e in
+  Mutex.lock t.lock;
+  let killed = Killable.finish call.query t.lock t.changed in
+  if not killed then begin
+    let first = earliest call t.calls in
+    t.calls <- List.filter (fun c -> c != call) t.calls;
+    if first then Alarm.wake t.wakeup
+  end;
+  Mutex.unlock t.lock;
+  match outcome with
+  | Failed _ when killed -> raise (Error "Mysql.Watchdog: deadline exceeded")
+  | Failed e -> raise e
+  | Done x -> Killable.settle dbd ~killed; x
+
+(* put a MAX_EXECUTION_TIME optimizer hint right after the SELECT keyword *)
+let with_hint ms sql =
+  let n = String.length sql in
+  let rec skip i =
+    if i < n && (match sql.[i] with ' ' | '\t' | '\n' | '\r' -> true | _ -> false)
+    then skip (i + 1) else i
+  in
+  let i = skip 0 in
+  if n - i > 6 && String.lowercase_ascii (String.sub sql ~pos:i ~len:6) = "select" then
+    String.sub sql ~pos:0 ~len:(i + 6) ^
+    Printf.sprintf " /*+ MAX_EXECUTION_TIME(%d) */" ms ^
+    String.sub sql ~pos:(i + 6) ~len:(n - i - 6)
+  else
+    sql
+
+let exec t ~timeout ?(hint=false) dbd sql =
+  let sql = if hint then with_hint (int_of_float (ceil (timeout *. 1000.))) sql else sql in
+  guard t ~timeout dbd (fun () -> exec dbd sql)
+
+let execute t ~timeout dbd stmt params =
+  guard t ~timeout dbd (fun () -> Prepared.execute stmt params)
+
+let execute_null t ~timeout dbd stmt params =
+  guard t ~timeout dbd (fun () -> Prepared.execute_null stmt params)
+
+let close t =
+  Mutex.lock t.lock;
+  t.closed <- true;
+  Alarm.wake t.wakeup;
+  let idle = t.idle in
+  t.idle <- [];
+  Mutex.unlock t.lock;
+  (match t.watcher with Some th -> Thread.join th; Alarm.close t.wakeup | None -> ());
+  t.watcher <- None;
+  List.iter (fun c -> try disconnect c with _ -> ()) idle
+
+end
+
+module Router = struct
+
+type backend = {
+  db : db;
+  options : db_option list;
+  mutable idle : dbd list;
+  mutable outstanding : int; (* requests currently running on this backend *)
+  mutable healthy : bool;
+  mutable lag : float option; (* seconds behind the primary, None if unknown *)
+  mutable sampled : float; (* time of the last successful lag sample *)
+  mutable probe : dbd option; (* lag sampling connection, only used by its sampler *)
+}
+
+type t = {
+  primary : backend;
+  replicas : backend array;
+  pool_size : int;
+  max_lag : float;
+  interval : float;
+  lock : Mutex.t;
+  latency : int array; (* histogram of replica read latencies, see [bucket] *)
+  mutable samples : int;
+  mutable rr : int;
+  mutable closed : bool;
+  mutable samplers : (Thread.t * Alarm.t) list; (* one per replica *)
+}
+
+(* the backend could not be used, the request may go elsewhere *)
+exception Down of exn
+
+(* latency bucket [i] counts the reads that took less than 10us * 1.2^i *)
+let buckets = 80
+
+let bucket x = max 0 (min (buckets - 1) (int_of_float (ceil (log (x /. 1e-5) /. log 1.2))))
+
+(* with [t.lock] held; counts are halved now and then so that the histogram follows
+   changes in latency *)
+let record t x =
+  if t.samples >= 10000 then begin
+    Array.iteri t.latency ~f:(fun i n -> t.latency.(i) <- n / 2);
+    t.samples <- Array.fold_left t.latency ~f:(+) ~init:0
+  end;
+  let i = bucket x in
+  t.latency.(i) <- t.latency.(i) + 1;
+  t.samples <- t.samples + 1
+
+let percentile t p =
+  Mutex.lock t.lock;
+  let target = int_of_float (ceil (p *. float_of_int t.samples)) in
+  let rec find i acc =
+    if i = buckets then None
+    else
+      let acc = acc + t.latency.(i) in
+      if acc >= target then Some (1e-5 *. 1.2 ** float_of_int i) else find (i + 1) acc
+  in
+  let r = if t.samples < 20 then None else find 0 0 in
+  Mutex.unlock t.lock;
+  r
+
+let backend options db =
+  { db = db; options = options; idle = []; outstanding = 0; healthy = true; lag = None;
+    sampled = neg_infinity; probe = None }
+
+let checkin t b c ~broken =
+  Mutex.lock t.lock;
+  b.outstanding <- b.outstanding - 1;
+  let keep = not broken && not t.closed && List.length b.idle < t.pool_size in
+  let drop =
+    if broken then begin
+      (* the other idle connections are most likely dead as well *)
+      let idle = b.idle in
+      b.healthy <- false;
+      b.idle <- [];
+      idle
+    end
+    else []
+  in
+  (match c with Some c when keep -> b.idle <- c :: b.idle | _ -> ());
+  Mutex.unlock t.lock;
+  (match c with Some c when not keep -> (try disconnect c with _ -> ()) | _ -> ());
+  List.iter (fun c -> try disconnect c with _ -> ()) drop
+
+let checkout t b =
+  Mutex.lock t.lock;
+  b.outstanding <- b.outstanding + 1;
+  let c = match b.idle with c :: rest -> b.idle <- rest; Some c | [] -> None in
+  Mutex.unlock t.lock;
+  match c with
+  | Some c -> c
+  | None ->
+    try connect ~options:b.options b.db
+    with e -> checkin t b None ~broken:true; raise (Down e)
+
+let use t b f =
+  let c = checkout t b in
+  match f c with
+  | x -> checkin t b (Some c) ~broken:false; x
+  | exception (Error _ as e) when Retry.lost_connection (Retry.classify c e) ->
+    checkin t b (Some c) ~broken:true;
+    raise (Down e)
+  | exception e -> checkin t b (Some c) ~broken:false; raise e
+
+(* a lag sample expires when the next one is overdue: one interval for the
+   wait and one for the probe's timeout *)
+let eligible t now b =
+  b.healthy && now -. b.sampled <= 2. *. t.interval
+  && (match b.lag with Some lag -> lag <= t.max_lag | None -> false)
+
+(* with [t.lock] held: the eligible replica with the least outstanding requests *)
+let pick t tried =
+  let n = Array.length t.replicas in
+  let now = Unix.gettimeofday () in
+  let best = ref None in
+  for k = 0 to n - 1 do
+    let b = t.replicas.((t.rr + k) mod n) in
+    if eligible t now b && not (List.memq b tried) then
+      match !best with
+      | Some b' when b'.outstanding <= b.outstanding -> ()
+      | _ -> best := Some b
+  done;
+  if n > 0 then t.rr <- (t.rr + 1) mod n;
+  !best
+
+type token = { mutable gtids : string option }
+
+let token () = { gtids = None }
+
+(* the GTIDs written by [f]: those reported to session tracking while it
+   ran, and those of its last statement, which may have been a prepared one *)
+let written dbd f =
+  ignore (collect_gtids dbd true);
+  let x = try f dbd with e -> ignore (collect_gtids dbd false); raise e in
+  let ends_with all last =
+    let n = String.length all and k = String.length last in
+    n >= k && String.sub all ~pos:(n - k) ~len:k = last
+  in
+  let gtids =
+    match collect_gtids dbd false, last_gtids dbd with
+    | Some all, Some last when not (ends_with all last) -> Some (all ^ "," ^ last)
+    | (Some _ as all), _ -> all
+    | None, last -> last
+  in
+  x, gtids
+
+let write ?token t f =
+  let f dbd =
+    match token with
+    | None -> f dbd
+    | Some token ->
+      let x, gtids = written dbd f in
+      if gtids <> None then token.gtids <- gtids;
+      x
+  in
+  match use t t.primary f with
+  | x -> x
+  | exception Down e -> raise e
+
+let transaction ?token ?read_only ?consistent_snapshot t f =
+  write ?token t (fun dbd -> transaction ?read_only ?consistent_snapshot dbd f)
+
+(* whether the replica has applied [gtids], waiting at most [wait] seconds *)
+let caught_up dbd gtids wait =
+  let sql =
+    if wait > 0. then
+      Printf.sprintf "SELECT WAIT_FOR_EXECUTED_GTID_SET(%s, %.3f) = 0" (ml2rstr dbd gtids) wait
+    else
+      Printf.sprintf "SELECT GTID_SUBSET(%s, @@GLOBAL.gtid_executed)" (ml2rstr dbd gtids)
+  in
+  match fetch (exec dbd sql) with
+  | Some [| Some "1" |] -> true
+  | _ -> false
+  | exception Error _ -> false
+
+let read ?token ?(wait=0.) t f =
+  let on_replica =
+    match token with
+    | Some { gtids = Some gtids } -> (fun dbd -> if caught_up dbd gtids wait then Some (f dbd) else None)
+    | _ -> (fun dbd -> Some (f dbd))
+  in
+  let rec attempt tried =
+    Mutex.lock t.lock;
+    let b = pick t tried in
+    Mutex.unlock t.lock;
+    match b with
+    | None -> None
+    | Some b ->
+      let start = Unix.gettimeofday () in
+      match use t b on_replica with
+      | x ->
+        let elapsed = Unix.gettimeofday () -. start in
+        Mutex.lock t.lock;
+        record t elapsed;
+        Mutex.unlock t.lock;
+        x
+      | exception Down _ -> attempt (b :: tried)
+  in
+  match attempt [] with
+  | Some x -> x
+  | None -> write t f
+
+type outcome = Pending | Answer of result | Raised of exn
+
+(* one of the concurrent executions of a hedged read *)
+type attempt = {
+  backend : backend;
+  started : float;
+  query : Killable.t;
+  mutable outcome : outcome;
+}
+
+exception Cancelled
+
+let kill_query t b thread =
+  try use t b (fun dbd -> ignore (exec dbd (Printf.sprintf "KILL QUERY %d" thread)))
+  with _ -> ()
+
+let hedged t sql =
+  let m = Mutex.create () and changed = Condition.create () in
+  (* wakes the caller while it waits for the hedging delay *)
+  let alarm = Alarm.create () and waiting = ref true in
+  let launch b =
+    let a = { backend = b; started = Unix.gettimeofday (); query = Killable.create (-1); outcome = Pending } in
+    let q = a.query in
+    let run dbd =
+      Mutex.lock m;
+      let cancelled = q.Killable.state <> Killable.Running in
+      if not cancelled then q.Killable.thread <- thread_id dbd;
+      Mutex.unlock m;
+      if cancelled then raise Cancelled;
+      let r = try Answer (exec dbd sql) with e -> Raised e in
+      Mutex.lock m;
+      let killed = Killable.finish q m changed in
+      Mutex.unlock m;
+      match r with
+      | Answer res -> Killable.settle dbd ~killed; res
+      | Raised e -> raise e
+      | Pending -> assert false
+    in
+    let body () =
+      let r = match use t b run with res -> Answer res | exception e -> Raised e in
+      Mutex.lock m;
+      q.Killable.state <- Killable.Finished;
+      a.outcome <- r;
+      Condition.broadcast changed;
+      if !waiting then Alarm.wake alarm;
+      Mutex.unlock m
+    in
+    ignore (Thread.create body ());
+    a
+  in
+  let cancel a =
+    (* with [m] held; the KILL is sent from a thread of its own so that the
+       winner is returned without waiting for it *)
+    let q = a.query in
+    match q.Killable.state with
+    | Killable.Running when q.Killable.thread < 0 -> q.Killable.state <- Killable.Killed
+    | Killable.Running ->
+      q.Killable.state <- Killable.Killing;
+      let kill () =
+        kill_query t a.backend q.Killable.thread;
+        Mutex.lock m;
+        q.Killable.state <- Killable.Killed;
+        Condition.broadcast changed;
+        Mutex.unlock m
+      in
+      ignore (Thread.create kill ())
+    | Killable.Killing | Killable.Killed | Killable.Finished -> ()
+  in
+  let pending a = match a.outcome with Pending -> true | Answer _ | Raised _ -> false in
+  let answered a = match a.outcome with Answer _ -> true | Pending | Raised _ -> false in
+  Mutex.lock t.lock;
+  let first = pick t [] in
+  Mutex.unlock t.lock;
+  match first with
+  | None -> Alarm.close alarm; write t (fun dbd -> exec dbd sql)
+  | Some b ->
+    let delay = percentile t 0.95 in
+    let a1 = launch b in
+    Mutex.lock m;
+    (match delay with
+     | Some delay ->
+       let deadline = a1.started +. delay in
+       while pending a1 && Unix.gettimeofday () < deadline do
+         Alarm.wait alarm m (deadline -. Unix.gettimeofday ())
+       done
+     | None -> ());
+    waiting := false;
+    Alarm.close alarm;
+    let second =
+      if pending a1 then begin
+        Mutex.lock t.lock;
+        let b2 = pick t [b] in
+        Mutex.unlock t.lock;
+        match b2 with Some b2 -> Some (launch b2) | None -> None
+      end
+      else None
+    in
+    let attempts = match second with Some a2 -> [a1; a2] | None -> [a1] in
+    (* the first answer wins, an error only counts when there is no other attempt left *)
+    while not (List.exists answered attempts) && List.exists pending attempts do
+      Condition.wait changed m
+    done;
+    let winner = try List.find answered attempts with Not_found -> a1 in
+    List.iter (fun a -> if a != winner then cancel a) attempts;
+    Mutex.unlock m;
+    match winner.outcome with
+    | Answer res ->
+      let elapsed = Unix.gettimeofday () -. winner.started in
+      Mutex.lock t.lock;
+      record t elapsed;
+      Mutex.unlock t.lock;
+      res
+    | Raised (Down _) -> read t (fun dbd -> exec dbd sql)
+    | Raised e -> raise e
+    | Pending -> assert false
+
+let select ?(hedge=false) t sql =
+  if hedge then hedged t sql else read t (fun dbd -> exec dbd sql)
+
+let latency t p = percentile t p
+
+(* replication lag as reported by the replica, None if replication is not running *)
+let replica_lag dbd =
+  let r = try exec dbd "SHOW REPLICA STATUS" with Error _ -> exec dbd "SHOW SLAVE STATUS" in
+  match fetch r with
+  | None -> None
+  | Some row ->
+    let names = names r in
+    let rec find i =
+      if i = Array.length names then None
+      else match names.(i) with
+        | "Seconds_Behind_Source" | "Seconds_Behind_Master" -> opt float2ml row.(i)
+        | _ -> find (i + 1)
+    in
+    find 0
+
+(* the probe connection gives up after about one sampling interval *)
+let probe_options t b =
+  let n = max 1 (int_of_float (ceil t.interval)) in
+  b.options @ [OPT_CONNECT_TIMEOUT n; OPT_READ_TIMEOUT n; OPT_WRITE_TIMEOUT n]
+
+let sample t b =
+  let status =
+    match (match b.probe with Some c -> c | None -> connect ~options:(probe_options t b) b.db) with
+    | exception _ -> None
+    | c ->
+      b.probe <- Some c;
+      match replica_lag c with
+      | lag -> Some lag
+      | exception _ -> (try disconnect c with _ -> ()); b.probe <- None; None
+  in
+  Mutex.lock t.lock;
+  (match status with
+   | Some lag -> b.healthy <- true; b.lag <- lag; b.sampled <- Unix.gettimeofday ()
+   | None -> b.healthy <- false; b.lag <- None);
+  Mutex.unlock t.lock
+
+(* replicas are sampled by a thread each, so that a slow one does not hold up
+   the others *)
+let rec sampler t b stop =
+  sample t b;
+  Mutex.lock t.lock;
+  if not t.closed then Alarm.wait stop t.lock t.interval;
+  let closed = t.closed in
+  Mutex.unlock t.lock;
+  if not closed then sampler t b stop
+
+let create ?(options=[]) ?(pool_size=8) ?(max_lag=1.0) ?(lag_interval=1.0) ?(track_gtids=false)
+    ~primary ~replicas () =
+  let primary_options =
+    if track_gtids then
+      options @ [OPT_SESSION_TRACK; INIT_COMMAND "SET SESSION session_track_gtids = OWN_GTID"]
+    else
+      options
+  in
+  let t = { primary = backend primary_options primary;
+            replicas = Array.of_list (List.map (backend options) replicas);
+            pool_size = pool_size; max_lag = max_lag; interval = lag_interval;
+            lock = Mutex.create (); latency = Array.make buckets 0; samples = 0;
+            rr = 0; closed = false; samplers = [] } in
+  t.samplers <-
+    Array.to_list (Array.map t.replicas ~f:(fun b ->
+      let stop = Alarm.create () in
+      Thread.create (fun () -> sampler t b stop) (), stop));
+  t
+
+let close t =
+  Mutex.lock t.lock;
+  t.closed <- true;
+  List.iter (fun (_, stop) -> Alarm.wake stop) t.samplers;
+  Mutex.unlock t.lock;
+  List.iter (fun (th, stop) -> Thread.join th; Alarm.close stop) t.samplers;
+  t.samplers <- [];
+  let shut b =
+    let conns = (match b.probe with Some c -> [c] | None -> []) @ b.idle in
+    b.probe <- None;
+    b.idle <- [];
+    List.iter (fun c -> try disconnect c with _ -> ()) conns
+  in
+  shut t.primary;
+  Array.iter t.replicas ~f:shut
+
+end
+
+module Compression = struct
+
+type sample = {
+  algorithm : string;
+  seconds : float;
+  cpu_seconds : float;
+  bytes : int64;
+}
+
+let bytes_sent dbd =
+  match fetch (exec dbd "SHOW SESSION STATUS LIKE 'Bytes_sent'") with
+  | Some [| _; Some v |] -> Int64.of_string v
+  | _ -> raise (Error "Mysql.Compression: Bytes_sent is not available")
+
+let cpu () = let t = Unix.times () in t.Unix.tms_utime +. t.Unix.tms_stime
+
+let measure ?(options=[]) ?level ~runs db sql algorithm =
+  let level = match level with Some n -> [OPT_ZSTD_COMPRESSION_LEVEL n] | None -> [] in
+  let dbd = connect ~options:(options @ OPT_COMPRESSION_ALGORITHMS algorithm :: level) db in
+  let bytes = ref 0L and seconds = ref 0. and cpu_seconds = ref 0. in
+  let run () =
+    let b0 = bytes_sent dbd in
+    let t0 = Unix.gettimeofday () and c0 = cpu () in
+    iter (exec dbd sql) ~f:ignore;
+    seconds := !seconds +. (Unix.gettimeofday () -. t0);
+    cpu_seconds := !cpu_seconds +. (cpu () -. c0);
+    bytes := Int64.add !bytes (Int64.sub (bytes_sent dbd) b0)
+  in
+  (try for _ = 1 to runs do run () done
+   with e -> disconnect dbd; raise e);
+  disconnect dbd;
+  let n = float_of_int runs in
+  { algorithm = algorithm; seconds = !seconds /. n; cpu_seconds = !cpu_seconds /. n;
+    bytes = Int64.div !bytes (Int64.of_int runs) }
+
+let benchmark ?options ?(algorithms=["uncompressed"; "zlib"; "zstd"]) ?zstd_level ?(runs=3) db sql =
+  List.map (fun a -> measure ?options ?level:(if a = "zstd" then zstd_level else None) ~runs db sql a)
+    algorithms
+
+end
+
+module Mirror = struct
+
+type snapshot = {
+  columns : string array;
+  rows : string option array StrMap.t; (* by key *)
+  version : string option; (* last result of the version query *)
+  watermark : string option; (* largest value of the change column loaded *)
+  loads : int; (* incremental loads since the last full one *)
+}
+
+type t = {
+  db : db;
+  options : db_option list;
+  table : string;
+  key : string;
+  version_sql : string option;
+  change_column : string option;
+  full_every : int;
+  interval : float;
+  mutable current : snapshot; (* replaced as a whole, read without locking *)
+  mutable dbd : dbd option; (* only used with [loading] held *)
+  loading : Mutex.t;
+  lock : Mutex.t;
+  stop : Alarm.t;
+  mutable closed : bool;
+  mutable reloader : Thread.t option;
+}
+
+let scalar dbd sql =
+  match fetch (exec dbd sql) with
+  | Some [| v |] -> v
+  | _ -> None
+
+(* add the rows returned by [sql] to [rows] *)
+let load dbd sql key rows =
+  let res = exec dbd sql in
+  let k = (Cell.positions res [| key |]).(0) in
+  let rows = ref rows in
+  iter res ~f:(fun row ->
+    match row.(k) with
+    | Some id -> rows := StrMap.add ~key:id ~data:row !rows
+    | None -> ());
+  names res, !rows
+
+let max_sql t col = Printf.sprintf "SELECT MAX(%s) FROM %s" col t.table
+
+let full t dbd version =
+  let watermark = match t.change_column with Some col -> scalar dbd (max_sql t col) | None -> None in
+  let columns, rows = load dbd ("SELECT * FROM " ^ t.table) t.key StrMap.empty in
+  { columns = columns; rows = rows; version = version; watermark = watermark; loads = 0 }
+
+(* the rows changed since the last load; the new watermark is read first so
+   that rows changed meanwhile are loaded again next time *)
+let incremental t dbd version snap col =
+  let watermark = scalar dbd (max_sql t col) in
+  if watermark = snap.watermark then { snap with version = version }
+  else
+    let where =
+      match snap.watermark with
+      | Some w -> Printf.sprintf " WHERE %s >= %s" col (ml2rstr dbd w)
+      | None -> ""
+    in
+    let _, rows = load dbd (Printf.sprintf "SELECT * FROM %s%s" t.table where) t.key snap.rows in
+    { snap with rows = rows; version = version; watermark = watermark; loads = snap.loads + 1 }
+
+let reload t dbd ~full:force =
+  let snap = t.current in
+  let version = match t.version_sql with Some sql -> scalar dbd sql | None -> None in
+  if force || t.version_sql = None || version <> snap.version then
+    t.current <-
+      match t.change_column with
+      | Some col when not force && snap.loads < t.full_every -> incremental t dbd version snap col
+      | _ -> full t dbd version
+
+let refresh ?(full=false) t =
+  Mutex.lock t.loading;
+  let run () =
+    let dbd =
+      match t.dbd with
+      | Some c -> c
+      | None -> let c = connect ~options:t.options t.db in t.dbd <- Some c; c
+    in
+    try reload t dbd ~full
+    with e -> (try disconnect dbd with _ -> ()); t.dbd <- None; raise e
+  in
+  match run () with
+  | () -> Mutex.unlock t.loading
+  | exception e -> Mutex.unlock t.loading; raise e
+
+let rec reloader t =
+  Mutex.lock t.lock;
+  if not t.closed then Alarm.wait t.stop t.lock t.interval;
+  let closed = t.closed in
+  Mutex.unlock t.lock;
+  if not closed then begin
+    (* on failure the last snapshot is served until the next attempt *)
+    (try refresh t with _ -> ());
+    reloader t
+  end
+
+let create ?(options=[]) ?(interval=60.) ?version ?change_column ?(full_every=60) db ~table ~key =
+  let empty = { columns = [||]; rows = StrMap.empty; version = None; watermark = None; loads = 0 } in
+  let t = { db = db; options = options; table = table; key = key; version_sql = version;
+            change_column = change_column; full_every = full_every; interval = interval;
+            current = empty; dbd = None; loading = Mutex.create (); lock = Mutex.create ();
+            stop = Alarm.create (); closed = false; reloader = None } in
+  (try refresh ~full:true t with e -> Alarm.close t.stop; raise e);
+  t.reloader <- Some (Thread.create reloader t);
+  t
+
+let find t key = StrMap.find_opt key t.current.rows
+
+let columns t = t.current.columns
+
+let length t = StrMap.cardinal t.current.rows
+
+let iter t ~f = StrMap.iter ~f:(fun ~key:_ ~data -> f data) t.current.rows
+
+let close t =
+  Mutex.lock t.lock;
+  t.closed <- true;
+  Alarm.wake t.stop;
+  Mutex.unlock t.lock;
+  (match t.reloader with Some th -> Thread.join th; Alarm.close t.stop | None -> ());
+  t.reloader <- None;
+  Mutex.lock t.loading;
+  (match t.dbd with Some c -> (try disconnect c with _ -> ()) | None -> ());
+  t.dbd <- None;
+  Mutex.unlock t.loading
+
+end
+
+module Mux = struct
+
+type handle
+
+external available : unit -> bool = "db_mux_available"
+external connect_nonblocking : db_option list -> db -> dbd = "db_connect_nonblocking"
+external mux_create : dbd array -> handle = "db_mux_create"
+external start : handle -> int -> string -> unit = "db_mux_start"
+external wait : handle -> float -> int array = "db_mux_wait"
+external take : handle -> int -> dbd -> result = "db_mux_result"
+external wake : handle -> unit = "db_mux_wake"
+external release : handle -> unit = "db_mux_close"
+
+type state = Pending | Done of result | Failed of exn
+
+type call = {
+  sql : string;
+  mutable state : state;
+  on_done : (call -> unit) option;
+}
+
+type t = {
+  conns : dbd array;
+  handle : handle option; (* None: a thread per connection *)
+  lock : Mutex.t;
+  arrived : Condition.t; (* for the connection threads *)
+  finished : Condition.t;
+  queue : call Queue.t;
+  busy : call option array;
+  mutable closed : bool;
+  mutable threads : Thread.t list;
+}
+
+(* the longest [wait], after which running statements are stepped anyway *)
+let tick = 0.05
+
+let pending c = match c.state with Pending -> true | Done _ | Failed _ -> false
+
+let settle t settled =
+  Mutex.lock t.lock;
+  List.iter (fun (c, st) -> c.state <- st) settled;
+  Condition.broadcast t.finished;
+  Mutex.unlock t.lock;
+  List.iter (fun (c, _) ->
+    match c.on_done with Some f -> (try f c with _ -> ()) | None -> ()) settled
+
+(* the loop failed with [e]: the running and queued calls fail with it, and
+   no more are taken *)
+let fail_all t e =
+  Mutex.lock t.lock;
+  t.closed <- true;
+  let failed = ref [] in
+  Array.iteri t.busy ~f:(fun i c ->
+    match c with
+    | Some c -> t.busy.(i) <- None; failed := (c, Failed e) :: !failed
+    | None -> ());
+  Queue.iter (fun c -> failed := (c, Failed e) :: !failed) t.queue;
+  Queue.clear t.queue;
+  Mutex.unlock t.lock;
+  settle t (List.rev !failed)
+
+(* the event loop: start queued statements on idle connections, wait for
+   any to finish, hand out their results; whether to go on *)
+let step t h =
+  let refused = ref [] in
+  Mutex.lock t.lock;
+  Array.iteri t.busy ~f:(fun i c ->
+    match c with
+    | None when not (Queue.is_empty t.queue) ->
+      let c = Queue.pop t.queue in
+      (try start h i c.sql; t.busy.(i) <- Some c
+       with e -> refused := (c, Failed e) :: !refused)
+    | _ -> ());
+  let idle = Array.for_all t.busy ~f:(function None -> true | Some _ -> false) in
+  let stop = t.closed && idle && Queue.is_empty t.queue in
+  Mutex.unlock t.lock;
+  if !refused <> [] then settle t !refused;
+  if not stop then begin
+    let settled =
+      Array.fold_right (wait h tick) ~init:[] ~f:(fun i acc ->
+        let st = match take h i t.conns.(i) with r -> Done r | exception e -> Failed e in
+        match t.busy.(i) with
+        | Some c -> t.busy.(i) <- None; (c, st) :: acc
+        | None -> acc)
+    in
+    if settled <> [] then settle t settled
+  end;
+  not stop
+
+let rec loop t h =
+  match step t h with
+  | true -> loop t h
+  | false -> ()
+  | exception e -> fail_all t e
+
+(* without the non-blocking API: a thread per connection *)
+let rec work t dbd =
+  Mutex.lock t.lock;
+  while Queue.is_empty t.queue && not t.closed do Condition.wait t.arrived t.lock done;
+  if Queue.is_empty t.queue then Mutex.unlock t.lock
+  else begin
+    let c = Queue.pop t.queue in
+    Mutex.unlock t.lock;
+    let st = match exec dbd c.sql with r -> Done r | exception e -> Failed e in
+    settle t [(c, st)];
+    work t dbd
+  end
+
+let create ?(options=[]) ?(connections=8) db =
+  if connections < 1 then invalid_arg "Mysql.Mux.create: connections";
+  let conns =
+    if available () then begin
+      let made = ref [] in
+      try
+        for _i = 1 to connections do made := connect_nonblocking options db :: !made done;
+        Array.of_list (List.rev !made)
+      with e -> List.iter (fun c -> try disconnect c with _ -> ()) !made; raise e
+    end
+    else connect_many ~options connections db
+  in
+  let handle =
+    if available () then
+      (try Some (mux_create conns)
+       with e -> Array.iter conns ~f:(fun c -> try disconnect c with _ -> ()); raise e)
+    else None
+  in
+  let t = { conns = conns; handle = handle; lock = Mutex.create ();
+            arrived = Condition.create (); finished = Condition.create ();
+            queue = Queue.create (); busy = Array.make connections None;
+            closed = false; threads = [] } in
+  t.threads <-
+    (match handle with
+     | Some h -> [Thread.create (loop t) h]
+     | None -> Array.to_list (Array.map conns ~f:(fun c -> Thread.create (work t) c)));
+  t
+
+let submit ?on_done t sql =
+  let c = { sql = sql; state = Pending; on_done = on_done } in
+  Mutex.lock t.lock;
+  if t.closed then begin
+    Mutex.unlock t.lock;
+    raise (Error "Mysql.Mux.submit: multiplexer is closed")
+  end;
+  Queue.push c t.queue;
+  (match t.handle with Some h -> wake h | None -> Condition.signal t.arrived);
+  Mutex.unlock t.lock;
+  c
+
+let await t c =
+  Mutex.lock t.lock;
+  while pending c do Condition.wait t.finished t.lock done;
+  Mutex.unlock t.lock;
+  match c.state with
+  | Done r -> r
+  | Failed e -> raise e
+  | Pending -> assert false
+
+let exec t sql = await t (submit t sql)
+
+let close t =
+  Mutex.lock t.lock;
+  let was_closed = t.closed in
+  t.closed <- true;
+  if not was_closed then
+    (match t.handle with Some h -> wake h | None -> Condition.broadcast t.arrived);
+  (* closed already if the loop failed, the threads are still to be joined *)
+  let threads = t.threads in
+  t.threads <- [];
+  Mutex.unlock t.lock;
+  if threads <> [] then begin
+    List.iter Thread.join threads;
+    (match t.handle with Some h -> release h | None -> ());
+    Array.iter t.conns ~f:(fun c -> try disconnect c with _ -> ())
+  end
+
 end
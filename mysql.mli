@@ -74,7 +74,17 @@ type db_option =
 | SET_CHARSET_NAME of string (** The name of the character set to use as the default character set. *)
 | SHARED_MEMORY_BASE_NAME of string (** The name of the shared-memory object for communication to the server 
                                         on Windows, if the server supports shared-memory connections *)
+| OPT_COMPRESSION_ALGORITHMS of string (** Permitted compression algorithms, a comma separated
+                                           list of ["zlib"], ["zstd"] and ["uncompressed"] (MySQL 8.0.18). *)
+| OPT_ZSTD_COMPRESSION_LEVEL of int (** Compression level (1 to 22) for zstd (MySQL 8.0.18). *)
+| OPT_MAX_ALLOWED_PACKET of int (** The largest packet, hence row or statement, the client accepts, in bytes. *)
+| OPT_NET_BUFFER_LENGTH of int (** Initial size of the client network buffer, in bytes. *)
+| OPT_BIND of string (** The local address to connect from, on hosts with several interfaces. *)
+| OPT_TCP_KEEPALIVE of int (** Enable TCP keepalive, the first probe being sent after this many
+                               idle seconds. The client library has no sub-second timeouts,
+                               see [OPT_READ_TIMEOUT] for detecting a dead server while waiting. *)
 | OPT_FOUND_ROWS  (** Return the number of found (matched) rows, not the number of changed rows. *)
+| OPT_SESSION_TRACK (** Ask the server to report session state changes (schema, system variables, GTIDs) in OK packets. *)
 
 (** [connect ?options db] connects to the database [db] and returns a handle for further use
    @param options connection specific options, default empty list
@@ -84,14 +94,47 @@ val connect : ?options:db_option list -> db -> dbd
 (** Shortcut for connecting to a database with mostly default field values *)
 val quick_connect: ?options:db_option list -> ?host:string -> ?database:string -> ?port:int -> ?password:string -> ?user:string -> ?socket:string -> unit -> dbd
 
+(** [connect_many n db] opens [n] connections to [db] concurrently, which saves
+    the handshake round trips of opening them one after the other. If one of them
+    fails, the others are closed and the exception is raised.
+    @param parallel maximum number of connections being opened at the same time, default 16
+    @param warmup run on each new connection, e.g. to prepare statements or set
+    session variables; an exception fails the whole call
+*)
+val connect_many : ?options:db_option list -> ?parallel:int -> ?warmup:(dbd -> unit) -> int -> db -> dbd array
+
+(** [auto_tune dbd] suggests buffer options for new connections running the same
+    workload as [dbd], from the widest row [dbd] has received so far (for stored
+    results, the sum of the widest cell of each column, which bounds it):
+    [OPT_MAX_ALLOWED_PACKET] with room for twice that row (at least 64MB), only
+    when that is more than [dbd] accepts now (the client default is 1GB), and
+    [OPT_NET_BUFFER_LENGTH] large enough to receive it in one read (16KB to 1MB).
+    Returns [[]] before any row has been received. *)
+val auto_tune : dbd -> db_option list
+
 (** {2 Altering a connection} *)
 
 (** [set_charset dbd charset] sets the current character set for [dbd] (aka [SET NAMES]).
     It is strongly recommended to set the charset explicitly after connecting to database, using this function.
     Available character sets are stored in [INFORMATION_SCHEMA.CHARACTER_SETS] table ([SHOW CHARACTER SET]).
+    Does nothing when the charset is known to be set already.
 *)
 val set_charset : dbd -> string -> unit
 
+(** [set_session_vars dbd vars] sets the session variables [vars], given as
+    (name, SQL expression) pairs such as [("time_zone", "'+00:00'")], with a single
+    [SET] statement. The variables last set to the same expression through this
+    function are left out, and no statement is sent when nothing is left.
+
+    The binding remembers the default database, the charset and these variables
+    for each connection, so that redundant {!select_db}, {!set_charset} and
+    [set_session_vars] calls cost no round trip. [USE], [SET], [CALL] and
+    [EXECUTE] statements run through {!exec} make it forget what they may have
+    changed; with [OPT_SESSION_TRACK] the changes reported by the server are
+    applied as well. Changes made in other ways (prepared statements, stored
+    functions) are not seen. *)
+val set_session_vars : dbd -> (string * string) list -> unit
+
 (** [change_user dbd db] tries to change the current user and database.
    The host and port fields of db are ignored. *)
 val change_user : dbd -> db -> unit
@@ -99,7 +142,8 @@ val change_user : dbd -> db -> unit
 (** Another shortcut *)
 val quick_change: ?user:string -> ?password:string -> ?database:string -> dbd -> unit
 
-(** [select_db] switches to a new db, using the current user and password. *)
+(** [select_db] switches to a new db, using the current user and password.
+    Does nothing when [dbd] is known to use this db already. *)
 val select_db   : dbd -> string -> unit
 
 (** [disconnect dbd] releases a database connection [dbd]. The handle [dbd] becomes invalid *)
@@ -108,6 +152,15 @@ val disconnect : dbd -> unit
 (** [ping dbd] makes sure the connection to the server is up, and re-establishes it if needed. *)
 val ping : dbd -> unit
 
+(** [reset dbd] clears the session state of [dbd] without reconnecting: open
+    transaction, temporary tables, user and session variables and server side
+    prepared statements are dropped, and the default database is kept.
+    Statements prepared on [dbd] become invalid. This is the cheap way to recycle
+    a pooled connection. Uses [mysql_reset_connection] when the client library and
+    the server have it, [COM_CHANGE_USER] with the current credentials otherwise. The cached charset
+    and session variables (see {!set_session_vars}) are forgotten. *)
+val reset : dbd -> unit
+
 (** {2 Information about a connection} *)
 
 (** [list_db] Return a list of all visible databases on the current server *)
@@ -125,14 +178,22 @@ val server_info : dbd -> string
 (** Return the protocol version being used *)
 val proto_info  : dbd -> int
 
+(** Return the server thread id of the connection, as used by [KILL] *)
+val thread_id   : dbd -> int
+
+(** Return the GTIDs of the transaction committed by the last statement, as reported
+    through session state tracking. Requires [OPT_SESSION_TRACK] and the
+    [session_track_gtids] server variable set to [OWN_GTID] or [ALL_GTIDS]. *)
+val last_gtids  : dbd -> string option
+
 (** {2 Errors} *)
 
 (** When most of the API functions fail, they raise this exception with a description of the failure. *)
 exception Error of string
 
 (** Possible error codes from a failed operation that doesn't throw an exception *)
-(* Auto-generated on Thu Feb 20 06:10:26 2003 from MySQL headers. *)
-type error_code = Aborting_connection | Access_denied_error | Alter_info | Bad_db_error | Bad_field_error | Bad_host_error | Bad_null_error | Bad_table_error | Blob_cant_have_default | Blob_key_without_length | Blob_used_as_key | Blobs_and_no_terminated | Cant_create_db | Cant_create_file | Cant_create_table | Cant_create_thread | Cant_delete_file | Cant_drop_field_or_key | Cant_find_dl_entry | Cant_find_system_rec | Cant_find_udf | Cant_get_stat | Cant_get_wd | Cant_initialize_udf | Cant_lock | Cant_open_file | Cant_open_library | Cant_read_charset | Cant_read_dir | Cant_remove_all_fields | Cant_reopen_table | Cant_set_wd | Checkread | Columnaccess_denied_error | Commands_out_of_sync | Con_count_error | Conn_host_error | Connection_error | Db_create_exists | Db_drop_delete | Db_drop_exists | Db_drop_rmdir | Dbaccess_denied_error | Delayed_cant_change_lock | Delayed_insert_table_locked | Disk_full | Dup_entry | Dup_fieldname | Dup_key | Dup_keyname | Dup_unique | Empty_query | Error_on_close | Error_on_read | Error_on_rename | Error_on_write | Field_specified_twice | File_exists_error | File_not_found | File_used | Filsort_abort | Forcing_close | Form_not_found | Function_not_defined | Get_errno | Got_signal | Grant_wrong_host_or_user | Handshake_error | Hashchk | Host_is_blocked | Host_not_privileged | Illegal_grant_for_table | Illegal_ha | Insert_info | Insert_table_used | Invalid_default | Invalid_group_func_use | Invalid_use_of_null | Ipsock_error | Key_column_does_not_exits | Key_not_found | Kill_denied_error | Load_info | Localhost_connection | Mix_of_group_func_and_fields | Multiple_pri_key | Namedpipe_connection | Namedpipeopen_error | Namedpipesetstate_error | Namedpipewait_error | Net_error_on_write | Net_fcntl_error | Net_packet_too_large | Net_packets_out_of_order | Net_read_error | Net_read_error_from_pipe | Net_read_interrupted | Net_uncompress_error | Net_write_interrupted | Nisamchk | No | No_db_error | No_raid_compiled | No_such_index | No_such_table | No_such_thread | No_tables_used | No_unique_logfile | Non_uniq_error | Nonexisting_grant | Nonexisting_table_grant | Nonuniq_table | Normal_shutdown | Not_allowed_command | Not_form_file | Not_keyfile | Null_column_in_index | Old_keyfile | Open_as_readonly | Out_of_memory | Out_of_resources | Out_of_sortmemory | Outofmemory | Parse_error | Password_anonymous_user | Password_no_match | Password_not_allowed | Primary_cant_have_null | Ready | Record_file_full | Regexp_error | Requires_primary_key | Server_gone_error | Server_handshake_err | Server_lost | Server_shutdown | Shutdown_complete | Socket_create_error | Stack_overrun | Syntax_error | Table_cant_handle_auto_increment | Table_cant_handle_blob | Table_exists_error | Table_must_have_columns | Table_not_locked | Table_not_locked_for_write | Tableaccess_denied_error | Tcp_connection | Textfile_not_readable | Too_big_fieldlength | Too_big_rowsize | Too_big_select | Too_big_set | Too_long_ident | Too_long_key | Too_long_string | Too_many_delayed_threads | Too_many_fields | Too_many_key_parts | Too_many_keys | Too_many_rows | Too_many_tables | Udf_exists | Udf_no_paths | Unexpected_eof | Unknown_character_set | Unknown_com_error | Unknown_error | Unknown_host | Unknown_procedure | Unknown_table | Unsupported_extension | Update_info | Update_without_key_in_safe_mode | Version_error | Wrong_auto_key | Wrong_column_name | Wrong_db_name | Wrong_field_spec | Wrong_field_terminators | Wrong_field_with_group | Wrong_group_field | Wrong_host_info | Wrong_key_column | Wrong_mrg_table | Wrong_outer_join | Wrong_paramcount_to_procedure | Wrong_parameters_to_procedure | Wrong_sub_key | Wrong_sum_select | Wrong_table_name | Wrong_value_count | Wrong_value_count_on_row | Yes
+(* Auto-generated on Sat Oct 17 18:40:32 2026 from MySQL headers. *)
+type error_code = Aborting_connection | Access_denied_error | Alter_info | Bad_db_error | Bad_field_error | Bad_host_error | Bad_null_error | Bad_table_error | Blob_cant_have_default | Blob_key_without_length | Blob_used_as_key | Blobs_and_no_terminated | Cant_create_db | Cant_create_file | Cant_create_table | Cant_create_thread | Cant_delete_file | Cant_drop_field_or_key | Cant_execute_in_read_only_transaction | Cant_find_dl_entry | Cant_find_system_rec | Cant_find_udf | Cant_get_stat | Cant_get_wd | Cant_initialize_udf | Cant_lock | Cant_open_file | Cant_open_library | Cant_read_charset | Cant_read_dir | Cant_remove_all_fields | Cant_reopen_table | Cant_set_wd | Checkread | Columnaccess_denied_error | Commands_out_of_sync | Con_count_error | Conn_host_error | Connection_error | Db_create_exists | Db_drop_delete | Db_drop_exists | Db_drop_rmdir | Dbaccess_denied_error | Delayed_cant_change_lock | Delayed_insert_table_locked | Disk_full | Dup_entry | Dup_fieldname | Dup_key | Dup_keyname | Dup_unique | Empty_query | Error_during_commit | Error_during_rollback | Error_on_close | Error_on_read | Error_on_rename | Error_on_write | Field_specified_twice | File_exists_error | File_not_found | File_used | Filsort_abort | Forcing_close | Form_not_found | Function_not_defined | Get_errno | Got_signal | Grant_wrong_host_or_user | Handshake_error | Hashchk | Host_is_blocked | Host_not_privileged | Illegal_grant_for_table | Illegal_ha | Insert_info | Insert_table_used | Invalid_default | Invalid_group_func_use | Invalid_use_of_null | Ipsock_error | Key_column_does_not_exits | Key_not_found | Kill_denied_error | Load_info | Localhost_connection | Lock_deadlock | Lock_wait_timeout | Malformed_packet | Mix_of_group_func_and_fields | Multiple_pri_key | Namedpipe_connection | Namedpipeopen_error | Namedpipesetstate_error | Namedpipewait_error | Net_error_on_write | Net_fcntl_error | Net_packet_too_large | Net_packets_out_of_order | Net_read_error | Net_read_error_from_pipe | Net_read_interrupted | Net_uncompress_error | Net_write_interrupted | Nisamchk | No | No_db_error | No_raid_compiled | No_such_index | No_such_table | No_such_thread | No_tables_used | No_unique_logfile | Non_uniq_error | Nonexisting_grant | Nonexisting_table_grant | Nonuniq_table | Normal_shutdown | Not_allowed_command | Not_form_file | Not_keyfile | Null_column_in_index | Old_keyfile | Open_as_readonly | Option_prevents_statement | Out_of_memory | Out_of_resources | Out_of_sortmemory | Outofmemory | Parse_error | Password_anonymous_user | Password_no_match | Password_not_allowed | Primary_cant_have_null | Query_interrupted | Query_timeout | Ready | Record_file_full | Regexp_error | Requires_primary_key | Server_gone_error | Server_handshake_err | Server_lost | Server_lost_extended | Server_shutdown | Shutdown_complete | Socket_create_error | Ssl_connection_error | Stack_overrun | Syntax_error | Table_cant_handle_auto_increment | Table_cant_handle_blob | Table_exists_error | Table_must_have_columns | Table_not_locked | Table_not_locked_for_write | Tableaccess_denied_error | Tcp_connection | Textfile_not_readable | Too_big_fieldlength | Too_big_rowsize | Too_big_select | Too_big_set | Too_long_ident | Too_long_key | Too_long_string | Too_many_concurrent_trxs | Too_many_delayed_threads | Too_many_fields | Too_many_key_parts | Too_many_keys | Too_many_rows | Too_many_tables | Too_many_user_connections | Udf_exists | Udf_no_paths | Unexpected_eof | Unknown_character_set | Unknown_com_error | Unknown_error | Unknown_host | Unknown_procedure | Unknown_table | Unsupported_extension | Update_info | Update_without_key_in_safe_mode | Version_error | Wrong_auto_key | Wrong_column_name | Wrong_db_name | Wrong_field_spec | Wrong_field_terminators | Wrong_field_with_group | Wrong_group_field | Wrong_host_info | Wrong_key_column | Wrong_mrg_table | Wrong_outer_join | Wrong_paramcount_to_procedure | Wrong_parameters_to_procedure | Wrong_sub_key | Wrong_sum_select | Wrong_table_name | Wrong_value_count | Wrong_value_count_on_row | Yes
 
 (** The status of a query *)
 type status =
@@ -162,6 +223,72 @@ type result
    the result. Check [status] for errors! *) 
 val exec : dbd -> string -> result
 
+(** [exec_spill ?dir dbd str] executes a SQL statement like [exec], but
+   streams the rows into an unlinked temporary file in [dir] (default
+   [$TMPDIR], else [/tmp]) instead of storing them in memory, and maps it.
+   The server is read at full speed and [dbd] is free for the next
+   statement when this returns, so results larger than memory do not tie
+   up the connection while they are processed.  The file goes away with
+   the result.
+
+   Spilled results support everything stored results do, from [fetch] and
+   [to_row] to [Cell], [Row], [Block], [Filter], [Index] and [Parallel].
+
+@raise Error if the statement or writing the spill file fails.
+*)
+val exec_spill : ?dir:string -> dbd -> string -> result
+
+(** What to do with a result that exceeds its limits: give it up with
+   [Error], closing the connection, or go on streaming the rows to a spill
+   file as [exec_spill] does. *)
+type on_limit = Abort | Spill
+
+(** [set_result_limits ?max_rows ?max_bytes ?on_limit ?dir dbd] bounds the
+   results [exec] returns on [dbd] to [max_rows] rows and [max_bytes] bytes
+   of row data; calling it without limits removes them.  With limits set,
+   [exec] streams the rows into memory, counting them as they arrive, and
+   [on_limit] (default [Abort]) decides what happens once a limit is
+   passed.  On [Abort] the connection is closed, as by [disconnect], rather
+   than the rest of the result read: the server ends the statement when it
+   fails to send the rows, and [dbd] has to be connected again.  On [Spill]
+   the rows go on into a temporary file in [dir].  A result within the
+   limits stays in memory; either way it supports everything a stored
+   result does.  The limits are kept across [reset] and [change_user].
+
+@raise Invalid_argument if a limit is negative.
+*)
+val set_result_limits : ?max_rows:int -> ?max_bytes:int -> ?on_limit:on_limit -> ?dir:string -> dbd -> unit
+
+(** [exec_limited ?max_rows ?max_bytes ?on_limit ?dir dbd str] is [exec]
+   under the given limits instead of those of [dbd]; without any it stores
+   the result as [exec] does without limits.
+
+@raise Error if the result exceeds a limit and [on_limit] is [Abort], the
+   connection being closed.
+*)
+val exec_limited : ?max_rows:int -> ?max_bytes:int -> ?on_limit:on_limit -> ?dir:string -> dbd -> string -> result
+
+(** What a statement run for its effect did: the affected rows and insert
+   id as [affected] and [insert_id] report them, the number of warnings,
+   and for UPDATE the rows matched and the rows changed by it (both equal
+   to [affected] for other statements). *)
+type dml_info = {
+  affected : int;
+  insert_id : int;
+  warnings : int;
+  matched : int;
+  changed : int;
+}
+
+(** [exec_dml dbd str] executes an INSERT, UPDATE, DELETE or other statement
+   run for its effect and returns its [dml_info], without allocating a
+   result handle or needing calls to [affected] and [insert_id].  Rows the
+   statement returns are read and discarded.
+
+@raise Error if the statement fails.
+*)
+val exec_dml : dbd -> string -> dml_info
+
 (** {2 Getting the results of a query} *)
 
 (** [fetch result] returns the next row from a result as [Some a] or [None] 
@@ -171,6 +298,13 @@ val exec : dbd -> string -> result
    position *)
 val fetch : result -> string option array option
 
+(** [fetch_cols result cols] is like [fetch], but only copies out the columns
+   at the positions [cols], in that order.
+
+@raise Invalid_argument if a position is out of range.
+*)
+val fetch_cols : result -> int array -> string option array option
+
 (** [to_row result row] sets the current row.
 
 @raise Invalid_argument if the row is out of range.
@@ -191,7 +325,10 @@ val size : result -> int64
 
    The iter forms are all tail-recursive, so they can be used with any
    size of results. The map forms are tail-recursive, but take up
-   space with the list they build. *)
+   space with the list they build. The col(s) forms only copy the
+   named columns out of each row (see {!fetch_cols}).
+
+   @raise Not_found in the col(s) forms if a column does not exist. *)
 
 val iter : result -> f:(string option array -> unit) -> unit
 val iter_col : result -> key:string -> f:(string option -> unit) -> unit
@@ -263,6 +400,28 @@ val fetch_fields : result -> field array option
 (** Returns information on a specific field, with the first field numbered 0 *)
 val fetch_field_dir : result -> int -> field option
 
+(** {1 Transactions} *)
+
+(** [autocommit dbd mode] turns autocommit mode on ([true]) or off ([false]) *)
+val autocommit : dbd -> bool -> unit
+
+(** [commit dbd] commits the current transaction *)
+val commit : dbd -> unit
+
+(** [rollback dbd] rolls back the current transaction *)
+val rollback : dbd -> unit
+
+(** [start_transaction dbd] starts a new transaction ([START TRANSACTION]).
+    @param read_only start a [READ ONLY] transaction, default [false]
+    @param consistent_snapshot start the transaction [WITH CONSISTENT SNAPSHOT], default [false]
+*)
+val start_transaction : ?read_only:bool -> ?consistent_snapshot:bool -> dbd -> unit
+
+(** [transaction dbd f] runs [f dbd] inside a transaction started with {!start_transaction}.
+    The transaction is committed if [f] returns and rolled back if [f] or the
+    commit raises; the exception is then re-raised. *)
+val transaction : ?read_only:bool -> ?consistent_snapshot:bool -> dbd -> (dbd -> 'a) -> 'a
+
 (** {1 Working with MySQL data types} *)
 
 (** [escape str] returns the same string as [str] in MySQL syntax with
@@ -358,6 +517,274 @@ val ml2timestampl   : year:int -> month:int -> day:int -> hour:int -> min:int ->
   SQL `insert ... values ( .. )' statements *)
 val values          : string list -> string
 
+(** {1 Typed cell access} *)
+
+(** Decoding the current row of a result straight from the client buffers,
+    without the [string option array] of {!fetch}. Column positions are
+    resolved once per result with {!Cell.positions}, e.g.
+
+{[
+type user = { id : int; name : string; score : float option }
+
+let users res =
+  Mysql.Cell.map res ~columns:[|"id"; "name"; "score"|] ~f:(fun r p ->
+    { id = Mysql.Cell.int r p.(0);
+      name = Mysql.Cell.string r p.(1);
+      score = Mysql.Cell.opt Mysql.Cell.float r p.(2) })
+]}
+
+    The decoders raise {!Error} on NULL and on text that does not parse.
+*)
+module Cell : sig
+
+(** [next res] moves to the next row of [res], [false] when there is none *)
+val next : result -> bool
+
+(** [positions res names] are the positions of the columns [names] in [res].
+    A name shared by several columns stands for the last one, as with the col(s)
+    forms of {!Mysql.iter}. Raises {!Error} for an unknown column. *)
+val positions : result -> string array -> int array
+
+(** [map res ~columns ~f] applies [f res positions] to every row of [res],
+    [positions] being those of [columns] *)
+val map : result -> columns:string array -> f:(result -> int array -> 'a) -> 'a list
+
+(** Decoders for the column at the given position in the current row. [int]
+    raises {!Error} for values that do not fit in an OCaml [int]. *)
+
+val is_null : result -> int -> bool
+val int : result -> int -> int
+val int64 : result -> int -> int64
+val float : result -> int -> float
+val string : result -> int -> string
+
+(** [opt f] is [None] for NULL, otherwise decodes with [f] *)
+val opt : (result -> int -> 'a) -> result -> int -> 'a option
+
+end
+
+(** {1 Row specifications} *)
+
+(** Describing the shape of rows once, e.g.
+
+{[
+let spec = Mysql.Row.(int "id" @ string "name" @ opt float "score")
+
+let rows : (int * (string * float option)) list = Mysql.Row.decode res spec
+]}
+
+    A specification is compiled per result, with its columns resolved, and a
+    single C call walks it to build the values of a whole batch of rows, without
+    the [string option array] of {!fetch}. *)
+module Row : sig
+
+type 'a t
+
+(** [int] raises {!Error} for values that do not fit in an OCaml [int] *)
+val int : string -> int t
+val int64 : string -> int64 t
+val float : string -> float t
+val string : string -> string t
+
+(** [opt int "score"] reads NULL as [None]. The other specifications raise
+    {!Error} on NULL. *)
+val opt : (string -> 'a t) -> string -> 'a option t
+
+(** Both columns (right associative) *)
+val ( @ ) : 'a t -> 'b t -> ('a * 'b) t
+
+(** [map f spec] applies [f] to the decoded values, e.g. to build records *)
+val map : ('a -> 'b) -> 'a t -> 'b t
+
+(** A specification compiled for a result *)
+type 'a decoder
+
+(** [decoder res spec] resolves the columns of [spec] in [res].
+    Raises {!Error} for an unknown column. *)
+val decoder : result -> 'a t -> 'a decoder
+
+(** [fetch d n] decodes the next [n] rows at most, [[||]] at the end of the result.
+    @raise Invalid_argument if [n <= 0] *)
+val fetch : 'a decoder -> int -> 'a array
+
+(** [decode res spec] decodes all the rows of [res], [batch] at a time (default 256) *)
+val decode : ?batch:int -> result -> 'a t -> 'a list
+
+end
+
+(** {1 Row blocks} *)
+
+(** Fetching many rows at once into a single buffer: the bytes of all cells go
+    into one [Bytes.t] and their positions into one [int array], so a block costs
+    a constant number of allocations whatever its size. Cells are addressed by
+    row (in the block) and column. *)
+module Block : sig
+
+type t = private {
+  mutable data : Bytes.t; (** bytes of all the cells *)
+  mutable cells : int array; (** offset and length of each cell, row after row; the length is -1 for NULL *)
+  mutable rows : int; (** number of rows in the block *)
+  mutable cols : int; (** number of columns *)
+}
+
+(** An empty block, to be filled by {!fill} *)
+val create : unit -> t
+
+(** [fill res b n] replaces the content of [b] with the next [n] rows of [res]
+    at most, reusing its buffers when they are large enough. Returns [false]
+    at the end of the result.
+    @param cols only copy the columns at these positions, which become
+    columns [0], [1]... of the block
+    @raise Invalid_argument if [n <= 0] *)
+val fill : ?cols:int array -> result -> t -> int -> bool
+
+(** [fetch res n] is a new block with the next [n] rows of [res] at most, or
+    [None] at the end of the result.
+    @raise Invalid_argument if [n <= 0] *)
+val fetch : ?cols:int array -> result -> int -> t option
+
+val rows : t -> int
+val cols : t -> int
+
+(** The cell [(row, col)] is [length b row col] bytes of [data b] from
+    [offset b row col] *)
+
+val data : t -> Bytes.t
+val offset : t -> int -> int -> int
+val length : t -> int -> int -> int
+val is_null : t -> int -> int -> bool
+
+(** [get b row col] copies the cell out, [None] for NULL *)
+val get : t -> int -> int -> string option
+
+(** [int b row col] parses the cell without copying it. Raises {!Error} on NULL and
+    for values that do not fit in an [int]. *)
+val int : t -> int -> int -> int
+
+(** [iter res ~f] calls [f block row] for every row of [res], fetching [batch]
+    rows (default 256) at a time into a single block *)
+val iter : ?batch:int -> ?cols:int array -> result -> f:(t -> int -> unit) -> unit
+
+end
+
+(** A reusable buffer for one row: a {!Block.t} read at row 0 *)
+type row_buffer = Block.t
+
+(** A new, empty row buffer *)
+val row_buffer : unit -> row_buffer
+
+(** [fetch_into res buf] copies the next row of [res] into [buf], growing its
+    buffers when needed and otherwise reusing them, so that a loop over a
+    result allocates nothing per row. The cells are read with
+    [Block.get buf 0 col], [Block.int buf 0 col], etc. Returns [false] at the end
+    of the result. *)
+val fetch_into : ?cols:int array -> result -> row_buffer -> bool
+
+(** {1 Filtering results} *)
+
+(** Predicates on the cells of a row, evaluated in C over the data of the result
+    so that only the matching rows are copied out. Columns are given by position
+    (see {!Cell.positions}), and NULL matches no predicate but [Null]. E.g.
+
+{[
+let f = Mysql.Filter.(prefix 1 "ab" &&& int_between 0 100 200) in
+Mysql.Filter.iter res f ~f:(fun row -> ...)
+]}
+*)
+module Filter : sig
+
+type t =
+  | Eq of int * string (** the cell is this string *)
+  | Prefix of int * string (** the cell starts with this string *)
+  | Range of int * string * string (** the cell is between both strings (inclusive, byte order) *)
+  | Int_range of int * int * int (** the cell is an integer between both (inclusive), none if the bounds are reversed *)
+  | Int_above of int * int (** the cell is an integer above this one, compared as a BIGINT *)
+  | Int_below of int * int (** the cell is an integer below this one, compared as a BIGINT *)
+  | Null of int (** the cell is NULL *)
+  | And of t * t
+  | Or of t * t
+  | Not of t
+
+val eq : int -> string -> t
+val prefix : int -> string -> t
+val between : int -> string -> string -> t
+val int_eq : int -> int -> t
+val int_between : int -> int -> int -> t
+
+(** [int_lt col n] and [int_gt col n] are open ended: a BIGINT cell beyond
+    the range of [int] still compares below [min_int] or above [max_int] *)
+val int_lt : int -> int -> t
+val int_gt : int -> int -> t
+val is_null : int -> t
+
+(** Conjunction and disjunction; named so that opening [Filter] leaves the
+    boolean operators alone *)
+val ( &&& ) : t -> t -> t
+val ( ||| ) : t -> t -> t
+val not_ : t -> t
+
+(** [fetch res f] is the next row of [res] matching [f], like {!Mysql.fetch}.
+    @param cols only copy out these columns, see {!Mysql.fetch_cols} *)
+val fetch : ?cols:int array -> result -> t -> string option array option
+
+(** [count res f] counts the rows of [res] matching [f] without copying any *)
+val count : result -> t -> int
+
+(** [iter res f ~f:g] applies [g] to the rows of [res] matching [f] *)
+val iter : ?cols:int array -> result -> t -> f:(string option array -> unit) -> unit
+
+(** [map res f ~f:g] applies [g] to the rows of [res] matching [f] *)
+val map : ?cols:int array -> result -> t -> f:(string option array -> 'a) -> 'a list
+
+end
+
+(** {1 Indexing results} *)
+
+(** Hash indexes over the rows of a result, for repeated lookups by key in a
+    table loaded once. The index only holds row positions: the rows stay in the
+    client buffers of the result and are copied out on lookup. *)
+module Index : sig
+
+type t
+
+(** [create res columns] indexes the rows of [res] on [columns]. Rows with a
+    NULL key are left out; of several rows with the same key, the first one is
+    found. Raises {!Error} for an unknown column. *)
+val create : result -> string array -> t
+
+(** [lookup ix key] is the row whose key (single column) is [key].
+    @param cols only copy out these columns, see {!Mysql.fetch_cols} *)
+val lookup : ?cols:int array -> t -> string -> string option array option
+
+(** [find ix keys] is the row whose key columns are [keys] *)
+val find : ?cols:int array -> t -> string array -> string option array option
+
+end
+
+(** {1 Parallel decoding} *)
+
+(** Decoding the rows of a result on several domains. The rows of a result are
+    all in client memory, so they are split by position into one contiguous
+    range per domain, each decoded with a {!Row} specification in chunks. The
+    rows and their lengths are listed first in the calling domain (a pointer and
+    a length per cell), the cursor of the result being left where it was. Before
+    OCaml 5 there are no domains: the ranges are decoded one after the other in
+    the calling thread. *)
+module Parallel : sig
+
+(** [iter res spec ~f] calls [f first rows] for each chunk of decoded [rows],
+    [first] being the position of the first one in [res]. [f] runs in the domain
+    which decoded the chunk, so it must be safe to run in parallel.
+    @param domains default [Domain.recommended_domain_count ()], 1 before OCaml 5
+    @param chunk rows decoded per C call, default 4096 *)
+val iter : ?domains:int -> ?chunk:int -> result -> 'a Row.t -> f:(int -> 'a array -> unit) -> unit
+
+(** [map res spec ~f] decodes and applies [f] to all the rows of [res] in
+    parallel, and returns the results in row order *)
+val map : ?domains:int -> ?chunk:int -> result -> 'a Row.t -> f:('a -> 'b) -> 'b array
+
+end
+
 (** {1 Prepared statements} *)
 
 (** Prepared statements with parameters. Consult the MySQL manual for detailed description 
@@ -381,6 +808,14 @@ val execute : stmt -> string array -> stmt_result
 (** Same as {!execute}, but with support for NULL values. *)
 val execute_null : stmt -> string option array -> stmt_result
 
+(** [execute_dml stmt params] is {!execute} for a statement run for its
+   effect, returning its {!Mysql.dml_info} instead of a result (see
+   {!Mysql.exec_dml}).  Rows the statement returns are discarded. *)
+val execute_dml : stmt -> string array -> dml_info
+
+(** Same as {!execute_dml}, but with support for NULL values. *)
+val execute_dml_null : stmt -> string option array -> dml_info
+
 (** @return Number of rows affected by the last execution of this statement. *)
 val affected : stmt -> int64
 
@@ -393,6 +828,10 @@ val real_status : stmt -> int
 (** @return the next row of the result set. *)
 val fetch : stmt_result -> string option array option
 
+(** [fetch_into r buf] copies the next row into [buf], see {!Mysql.fetch_into}.
+    Returns [false] when there are no more rows. *)
+val fetch_into : ?cols:int array -> stmt_result -> row_buffer -> bool
+
 (** @return metadata on the statement's result set. *)
 val result_metadata : stmt -> result
 
@@ -400,3 +839,331 @@ val result_metadata : stmt -> result
 val close : stmt -> unit
 
 end
+
+(** {1 Scanning large tables} *)
+
+(** Walking a table page by page with keyset pagination
+    ([WHERE (k1,k2) > (?,?) ORDER BY k1,k2 LIMIT n]), which keeps the cost
+    of every page constant and does not hold a long-running statement open. *)
+module Scan : sig
+
+(** [rows dbd ~table ~key] returns the rows of [table] ordered by the unique
+    [key] columns as a lazy sequence. Nothing is queried until the sequence is
+    forced. One prepared statement is reused for all pages after the first one.
+    Table, column and key names are inserted into the query verbatim.
+
+    The connection must not be used for anything else while the sequence is
+    being consumed: with [prefetch] the next page is requested in a separate
+    thread as soon as the current one is handed out. Key columns must not
+    contain NULL values. Integer key columns are bound as integers.
+
+    The prepared statement is closed when the end of the sequence is reached.
+    A sequence that is not consumed to the end keeps it (and possibly a
+    prefetch) until the connection is closed; use {!with_rows} then.
+
+    @param columns select list, default [[|"*"|]]; must contain the key columns
+    @param page_size number of rows fetched per query, default 1000
+    @param prefetch fetch the next page while the current one is processed, default [true]
+    @param after resume the scan after the given key values
+    @raise Error if the key columns are not selected or a query fails
+*)
+val rows : ?columns:string array -> ?page_size:int -> ?prefetch:bool -> ?after:string array ->
+  dbd -> table:string -> key:string array -> string option array Seq.t
+
+(** [with_rows dbd ~table ~key ~f] applies [f] to the sequence of {!rows} and
+    then releases the scan: it waits for a prefetch still running and closes
+    the prepared statement, also when [f] stops early or raises. The sequence
+    must not be used after [f] returned.
+*)
+val with_rows : ?columns:string array -> ?page_size:int -> ?prefetch:bool -> ?after:string array ->
+  dbd -> table:string -> key:string array -> f:(string option array Seq.t -> 'a) -> 'a
+
+end
+
+(** {1 Group commit} *)
+
+(** Batching of small writes coming from many threads into shared transactions,
+    so that commit throughput is not bound by one log flush per statement. *)
+module Group_commit : sig
+
+(** Group commit writer *)
+type t
+
+(** [create dbd] turns autocommit off on [dbd] and starts a background thread
+    committing the submitted statements. The connection is owned by the writer
+    until {!close}.
+    @param interval how long (in seconds) the first statement of a batch waits for others, default 0.005
+    @param max_batch commit as soon as that many statements are pending, default 100
+*)
+val create : ?interval:float -> ?max_batch:int -> dbd -> t
+
+(** [exec t sql] queues the statement [sql] and blocks until the transaction it
+    was grouped into is committed. Can be called from any thread.
+    A failing statement only fails its own caller: the batch is rolled back and
+    the other statements are retried in the next one.
+    @raise Error if [sql] or the commit failed, or the writer is closed *)
+val exec : t -> string -> unit
+
+(** [close t] commits the pending statements, stops the background thread and
+    turns autocommit back on *)
+val close : t -> unit
+
+end
+
+(** {1 Retrying transactions} *)
+
+(** Retrying of transactions aborted by lock conflicts or a lost connection,
+    with jittered exponential backoff. *)
+module Retry : sig
+
+(** [retryable code] is [true] for deadlocks, lock wait timeouts and lost connections *)
+val retryable : error_code -> bool
+
+(** [backoff n] is the longest delay before retrying after failed attempt [n]
+    (counting from 0): [min max_delay (base_delay * 2^n)] seconds.
+    @param base_delay default 0.01 seconds
+    @param max_delay default 1 second
+*)
+val backoff : ?base_delay:float -> ?max_delay:float -> int -> float
+
+(** [transaction dbd f] runs [f dbd] inside a transaction like {!Mysql.transaction},
+    and runs it again from the start if it or the commit fails with a {!retryable}
+    error. After failed attempt [n] (counting from 0) it waits a random delay of up
+    to [backoff n] seconds before the next one. The error is classified from the
+    exception, which also works for errors of prepared statements. A lost
+    connection is only retried when the connection was opened with
+    [OPT_RECONNECT true], so that {!ping} can re-establish it. [f] must be safe to run several times.
+    @param attempts maximum number of attempts, default 10
+    @param base_delay default 0.01 seconds
+    @param max_delay default 1 second
+    @param timeout give up when the next attempt would start later than that many seconds from now, default 30
+    @raise Error the last error when giving up
+*)
+val transaction : ?attempts:int -> ?base_delay:float -> ?max_delay:float -> ?timeout:float ->
+  ?read_only:bool -> ?consistent_snapshot:bool -> dbd -> (dbd -> 'a) -> 'a
+
+end
+
+(** {1 Query deadlines} *)
+
+(** Per-call deadlines. When a statement runs past its deadline it is cancelled on
+    the server with [KILL QUERY], issued from a small pool of control connections,
+    and the connection itself stays usable. The control connections use the same
+    login, so the user needs to be allowed to kill its own queries (the default). *)
+module Watchdog : sig
+
+(** Watchdog with its control connections *)
+type t
+
+(** [create db] starts a watchdog for queries running on connections to [db].
+    Control connections are opened on demand.
+    @param options connection options for the control connections
+    @param pool_size number of idle control connections kept open, default 2
+*)
+val create : ?options:db_option list -> ?pool_size:int -> db -> t
+
+(** [exec t ~timeout dbd sql] is {!Mysql.exec} with a deadline of [timeout] seconds.
+    @param hint also put a [MAX_EXECUTION_TIME] optimizer hint into [SELECT]
+    statements, so that the server stops them by itself, default [false]
+    @raise Error if the deadline was exceeded ([errno dbd] is then [Query_interrupted],
+    or [Query_timeout] when the hint fired first) *)
+val exec : t -> timeout:float -> ?hint:bool -> dbd -> string -> result
+
+(** [execute t ~timeout dbd stmt params] is {!Prepared.execute} with a deadline
+    of [timeout] seconds, [stmt] being prepared on [dbd]. Rows are fetched after
+    the call returns and are not covered by the deadline. *)
+val execute : t -> timeout:float -> dbd -> Prepared.stmt -> string array -> Prepared.stmt_result
+
+(** Same as {!execute}, but with support for NULL values. *)
+val execute_null : t -> timeout:float -> dbd -> Prepared.stmt -> string option array -> Prepared.stmt_result
+
+(** [close t] stops the watchdog and closes its control connections. Calls still
+    running are no longer watched. *)
+val close : t -> unit
+
+end
+
+(** {1 Read routing} *)
+
+(** Routing of requests over one primary and several replicas: writes and
+    transactions go to the primary, reads are balanced over the replicas.
+    The router keeps a pool of connections to every server. *)
+module Router : sig
+
+(** Router *)
+type t
+
+(** [create ~primary ~replicas ()] creates a router and starts a thread per replica
+    sampling its replication lag ([SHOW REPLICA STATUS], which requires the
+    [REPLICATION CLIENT] privilege). Probes time out after about [lag_interval]
+    seconds. Until a replica has been sampled, while its lag exceeds [max_lag] or
+    it is unreachable, and when its last sample is more than two intervals old,
+    reads do not go to it.
+    @param options connection options for all connections
+    @param pool_size number of idle connections kept open per server, default 8
+    @param max_lag maximum acceptable replication lag in seconds, default 1
+    @param lag_interval seconds between two lag samples, default 1
+    @param track_gtids enable GTID tracking on the primary connections, needed
+    for {!token}s to be filled in, default [false]
+*)
+val create : ?options:db_option list -> ?pool_size:int -> ?max_lag:float -> ?lag_interval:float ->
+  ?track_gtids:bool -> primary:db -> replicas:db list -> unit -> t
+
+(** A session token remembering the last write made through it, so that later
+    reads see it (read-your-writes). *)
+type token
+
+(** Create an empty token *)
+val token : unit -> token
+
+(** [read t f] runs [f] on a connection to the eligible replica with the least
+    outstanding requests. If the replica turns out to be unreachable, it is excluded
+    and [f] is run again on the next one, falling back to the primary when there is
+    none left. [f] must therefore be idempotent.
+    @param token only run [f] on a replica which has applied the last write recorded
+    in the token, otherwise on the primary
+    @param wait how long (in seconds) a replica may wait to catch up with the token
+    ([WAIT_FOR_EXECUTED_GTID_SET], fractional values need MySQL 8.0.18), default 0:
+    no waiting
+*)
+val read : ?token:token -> ?wait:float -> t -> (dbd -> 'a) -> 'a
+
+(** [select t sql] runs the query [sql] like [read t (fun dbd -> exec dbd sql)].
+    The result is stored on the client, so it outlives the connection.
+    @param hedge if the replica has not answered within the 95th percentile of the
+    read latencies observed so far, send the same query to a second replica. The
+    first answer wins and the other query is cancelled with [KILL QUERY]. [sql]
+    must not have side effects. Hedging starts after 20 reads have been timed,
+    default [false]
+*)
+val select : ?hedge:bool -> t -> string -> result
+
+(** [latency t p] is the [p] quantile (between 0 and 1) of the latencies, in
+    seconds, of the reads served by replicas, or [None] while too few reads have
+    been timed *)
+val latency : t -> float -> float option
+
+(** [write t f] runs [f] on a connection to the primary.
+    @param token record the GTIDs written by [f]: those of its commits and of the
+    statements it ran with {!Mysql.exec} and friends, and those of its last statement
+    when it was a prepared one; the token is left alone when there are none *)
+val write : ?token:token -> t -> (dbd -> 'a) -> 'a
+
+(** [transaction t f] runs [f] inside a transaction on the primary, see {!Mysql.transaction}.
+    @param token record the GTIDs of the transaction *)
+val transaction : ?token:token -> ?read_only:bool -> ?consistent_snapshot:bool -> t -> (dbd -> 'a) -> 'a
+
+(** [close t] stops lag sampling and closes the idle connections *)
+val close : t -> unit
+
+end
+
+(** {1 Network compression} *)
+
+module Compression : sig
+
+(** Average cost of running a query with one compression algorithm *)
+type sample = {
+  algorithm : string;
+  seconds : float; (** wall clock time to run the query and transfer the result *)
+  cpu_seconds : float; (** client CPU time (user and system) of the whole process *)
+  bytes : int64; (** bytes sent by the server, from its [Bytes_sent] status *)
+}
+
+(** [benchmark db sql] runs the query [sql] [runs] times over a new connection
+    for each of the [algorithms] (see [OPT_COMPRESSION_ALGORITHMS]) and reports
+    the average cost per run, to help choose the algorithm for a given result
+    shape and network.
+    @param algorithms default [["uncompressed"; "zlib"; "zstd"]]
+    @param zstd_level passed as [OPT_ZSTD_COMPRESSION_LEVEL] for zstd
+    @param runs default 3
+*)
+val benchmark : ?options:db_option list -> ?algorithms:string list -> ?zstd_level:int ->
+  ?runs:int -> db -> string -> sample list
+
+end
+
+(** {1 Mirrored tables} *)
+
+(** An in-process copy of a small table, reloaded in the background. Readers
+    never wait: a reload builds a new snapshot which then replaces the old one
+    at once. *)
+module Mirror : sig
+
+type t
+
+(** [create db ~table ~key] loads [table] over a connection of its own, then
+    reloads it every [interval] seconds (default 60). Rows are looked up by the
+    column [key]; rows with a NULL key are left out. Raises if the first load
+    fails; later failures keep the last snapshot until the next attempt.
+    @param version an SQL query returning a single value, e.g. from a version
+    table: the table is only reloaded when that value changed
+    @param change_column a column increased by every insert and update (e.g. an
+    [updated_at] timestamp): only the rows changed since the last load are
+    fetched, and a full reload every [full_every] (default 60) loads picks up
+    deleted rows
+*)
+val create : ?options:db_option list -> ?interval:float -> ?version:string ->
+  ?change_column:string -> ?full_every:int -> db -> table:string -> key:string -> t
+
+(** [find t key] is the row with this key in the current snapshot *)
+val find : t -> string -> string option array option
+
+(** Names of the columns of the rows *)
+val columns : t -> string array
+
+(** Number of rows in the current snapshot *)
+val length : t -> int
+
+(** [iter t ~f] applies [f] to the rows of the current snapshot, in key order *)
+val iter : t -> f:(string option array -> unit) -> unit
+
+(** [refresh t] reloads now, incrementally unless [full] (default [false]) *)
+val refresh : ?full:bool -> t -> unit
+
+(** [close t] stops the reloads and closes the connection *)
+val close : t -> unit
+
+end
+
+(** Many statements in flight over a set of connections, driven by a single
+    thread. Statements are submitted from any thread, started on the next idle
+    connection and completed through {!await} or an [on_done] callback. With a
+    client library providing the non-blocking API (MySQL 8.0.16 and later) on a
+    system with epoll, the connections are opened and served non-blocking from
+    one epoll loop; otherwise each connection gets a thread running {!Mysql.exec}. *)
+module Mux : sig
+
+type t
+
+(** A submitted statement *)
+type call
+
+(** [available ()] tells whether the non-blocking event loop is used *)
+val available : unit -> bool
+
+(** [create db] opens [connections] (default 8) connections to [db] owned by
+    the multiplexer. A non-blocking connect gives up after [OPT_CONNECT_TIMEOUT]
+    seconds, 30 without it.
+    @raise Error if a connection fails *)
+val create : ?options:db_option list -> ?connections:int -> db -> t
+
+(** [submit t sql] queues [sql] and returns at once. [on_done] is called with
+    the call from the event loop when it completed, where {!await} returns
+    without waiting; it should be quick, as it delays the other connections.
+    Should the event loop itself fail, the calls in flight and queued fail
+    with its exception and [t] is closed, to be released with {!close}.
+    @raise Error if [t] is closed *)
+val submit : ?on_done:(call -> unit) -> t -> string -> call
+
+(** [await t call] waits for [call] and returns its stored result, or raises
+    the error it failed with. *)
+val await : t -> call -> result
+
+(** [exec t sql] is [await t (submit t sql)] *)
+val exec : t -> string -> result
+
+(** [close t] finishes the submitted statements, then closes the connections *)
+val close : t -> unit
+
+end
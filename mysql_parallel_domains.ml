@@ -0,0 +1,8 @@
+(* The domains of Mysql.Parallel, OCaml 5 and later. configure links
+   mysql_parallel.ml to this file or to mysql_parallel_sequential.ml. *)
+
+type 'a t = 'a Domain.t
+
+let recommended_domain_count = Domain.recommended_domain_count
+let spawn = Domain.spawn
+let join = Domain.join
@@ -0,0 +1,9 @@
+(* The domains of Mysql.Parallel before OCaml 5: there are none, and each
+   part runs in the calling thread when it is joined. configure links
+   mysql_parallel.ml to this file or to mysql_parallel_domains.ml. *)
+
+type 'a t = unit -> 'a
+
+let recommended_domain_count () = 1
+let spawn f = f
+let join f = f ()
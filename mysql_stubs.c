@@ -6,6 +6,9 @@
 #include <stdio.h>              /* sprintf */
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
 
 /* OCaml runtime system */
 #define CAML_NAME_SPACE
@@ -25,12 +28,21 @@
 /* MySQL API */
 
 #if defined(_WIN32)
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 /* mode_t typedef conflict (mingw and mysql) */
 #ifdef __MINGW32__
 #include <winsock.h>
 #else
 #include <my_global.h>
 #endif
+#else
+#include <sys/socket.h>         /* OPT_TCP_KEEPALIVE */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>           /* exec_spill */
+#include <unistd.h>
+#include <strings.h>            /* strcasecmp */
 #endif
 
 #if defined(HAVE_MYSQL_MYSQL_H)
@@ -39,6 +51,17 @@
 #include <mysql.h>
 #endif
 
+/* Mysql.Mux drives connections through the non-blocking client API */
+#if HAVE_DECL_MYSQL_REAL_QUERY_NONBLOCKING && defined(HAVE_SYS_EPOLL_H)
+#define ML_MUX 1
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+/* seconds a non-blocking connect may take without OPT_CONNECTTIMEOUT */
+#define MUX_CONNECT_TIMEOUT 30
+#endif
+
 #define EXTERNAL                /* dummy to highlight fn's exported to ML */
 
 #ifdef CAML_TEST_GC_SAFE
@@ -53,12 +76,13 @@
  *      header with Abstract_tag
  *      0:      MYSQL*
  *      1:      bool    (open == true, closed == false)
+ *      2:      struct session* (cached session state)
  *
  * res - result returned from query/exec
  *
- *      header with Final_tag
- *      0:      finalization function for 1
- *      1:      MYSQL_RES*
+ *      custom block (res_ops)
+ *      struct result: MYSQL_RES* and, for exec_spill, the struct spill*
+ *      holding the rows
  *
  */
 
@@ -66,11 +90,21 @@
 
 #define DBDmysql(x) ((MYSQL*)(Field(x,1)))
 #define DBDopen(x) (Field(x,2))
-#define RESval(x) (*(MYSQL_RES**)Data_custom_val(x))
+#define DBDsession(x) ((struct session*)(Field(x,3)))
+#define RESULTval(x) ((struct result*)Data_custom_val(x))
+#define RESval(x) (RESULTval(x)->res)
+#define SPILLval(x) (RESULTval(x)->spill)
 
 #define STMTval(x) (*(MYSQL_STMT**)Data_custom_val(x))
 #define ROWval(x) (*(row_t**)Data_custom_val(x))
 
+struct spill;
+
+struct result {
+  MYSQL_RES *res;               /* metadata only for spilled results */
+  struct spill *spill;
+};
+
 static void mysqlfailwith(char *err) Noreturn;
 static void mysqlfailmsg(const char *fmt, ...) Noreturn;
 
@@ -166,6 +200,282 @@ check_db(value dbd, const char *fun)
 }
 
 
+/* Session state cache
+ *
+ * What is known about the session of a connection, so that redundant
+ * select_db, set_charset and set_session_vars calls need not go to the
+ * server.  NULL means unknown.  The state is kept current from session
+ * tracking when the connection has it (OPT_SESSION_TRACK); statements that
+ * may change the session (USE, SET, CALL, EXECUTE) drop what they could
+ * have changed.
+ */
+
+struct session_var {
+  char *name;
+  char *value;                  /* as given to set_session_vars */
+  struct session_var *next;
+};
+
+/* limits on the result of a statement (Mysql.set_result_limits), 0 for
+ * none; past them the result is given up or spilled to a file in dir
+ */
+
+struct limits {
+  my_ulonglong rows;
+  unsigned long long bytes;
+  int spill;
+  char *dir;                    /* NULL for $TMPDIR */
+};
+
+struct session {
+  unsigned long thread;         /* server thread the state belongs to */
+  char *schema;
+  char *charset;
+  struct session_var *vars;
+  unsigned long max_row;        /* widest row received, kept across resets */
+  struct limits limits;         /* client side, kept across resets */
+  int collect_gtids;            /* collect the GTIDs reported by statements */
+  char *gtids;                  /* collected so far, comma separated */
+};
+
+#if defined(CLIENT_SESSION_TRACK)
+#define ML_SESSION_TRACK CLIENT_SESSION_TRACK
+#elif defined(CLIENT_SESSION_TRACKING)
+#define ML_SESSION_TRACK CLIENT_SESSION_TRACKING
+#endif
+
+static char*
+copy_mem(const char *s, size_t len)
+{
+  char *r = malloc(len + 1);
+  if (!r)
+    caml_raise_out_of_memory();
+  memcpy(r, s, len);
+  r[len] = '\0';
+  return r;
+}
+
+static void
+session_set(char **slot, const char *s, size_t len)
+{
+  free(*slot);
+  *slot = s ? copy_mem(s, len) : NULL;
+}
+
+static void
+session_drop_var(struct session *st, const char *name, size_t len)
+{
+  struct session_var **p = &st->vars, *v;
+
+  while ((v = *p) != NULL)
+    if (strlen(v->name) == len && 0 == strncasecmp(v->name, name, len))
+    {
+      *p = v->next;
+      free(v->name); free(v->value); free(v);
+    }
+    else
+      p = &v->next;
+}
+
+static void
+session_put_var(struct session *st, const char *name, size_t nlen, const char *val, size_t vlen)
+{
+  struct session_var *v = malloc(sizeof *v);
+
+  if (!v)
+    caml_raise_out_of_memory();
+  session_drop_var(st, name, nlen);
+  v->name = copy_mem(name, nlen);
+  v->value = copy_mem(val, vlen);
+  v->next = st->vars;
+  st->vars = v;
+}
+
+static struct session_var*
+session_find_var(struct session *st, const char *name)
+{
+  struct session_var *v;
+
+  for (v = st->vars; v; v = v->next)
+    if (0 == strcasecmp(v->name, name))
+      return v;
+  return NULL;
+}
+
+static void
+session_clear(struct session *st, int keep_schema)
+{
+  if (!keep_schema)
+    session_set(&st->schema, NULL, 0);
+  session_set(&st->charset, NULL, 0);
+  while (st->vars)
+    session_drop_var(st, st->vars->name, strlen(st->vars->name));
+}
+
+static void
+session_free(struct session *st)
+{
+  if (st)
+  {
+    session_clear(st, 0);
+    free(st->limits.dir);
+    free(st->gtids);
+    free(st);
+  }
+}
+
+/* the state of an open connection, forgotten when the client library
+ * reconnected behind our back (OPT_RECONNECT)
+ */
+
+static struct session*
+session_of(value dbd)
+{
+  struct session *st = DBDsession(dbd);
+  unsigned long thread = mysql_thread_id(DBDmysql(dbd));
+
+  if (st->thread != thread)
+  {
+    session_clear(st, 0);
+    st->thread = thread;
+  }
+  return st;
+}
+
+/* a changed character_set_* or collation_* variable invalidates the charset */
+
+static void
+session_var_changed(struct session *st, const char *name, size_t len)
+{
+  session_drop_var(st, name, len);
+  if ((len >= 14 && 0 == strncasecmp(name, "character_set_", 14))
+      || (len >= 10 && 0 == strncasecmp(name, "collation_", 10)))
+    session_set(&st->charset, NULL, 0);
+}
+
+/* append a GTID set to the collected ones */
+
+static void
+session_add_gtids(struct session *st, const char *data, size_t length)
+{
+  size_t old = st->gtids ? strlen(st->gtids) : 0;
+  char *p;
+
+  if (length == 0)
+    return;
+  if ((p = realloc(st->gtids, old + length + 2)) == NULL)
+    caml_raise_out_of_memory();
+  if (old)
+    p[old++] = ',';
+  memcpy(p + old, data, length);
+  p[old + length] = '\0';
+  st->gtids = p;
+}
+
+/* apply the changes reported by session tracking for the last statement */
+
+static void
+session_track(MYSQL *mysql, struct session *st)
+{
+#if HAVE_DECL_MYSQL_SESSION_TRACK_GET_FIRST && defined(ML_SESSION_TRACK)
+  const char *data, *name;
+  size_t length, name_length;
+
+  if (!(mysql->client_flag & ML_SESSION_TRACK))
+    return;
+  if (st->collect_gtids
+      && 0 == mysql_session_track_get_first(mysql, SESSION_TRACK_GTIDS, &data, &length))
+    do
+      session_add_gtids(st, data, length);
+    while (0 == mysql_session_track_get_next(mysql, SESSION_TRACK_GTIDS, &data, &length));
+  if (0 == mysql_session_track_get_first(mysql, SESSION_TRACK_SCHEMA, &data, &length))
+    session_set(&st->schema, data, length);
+  /* reported as name, value, name, value... */
+  if (0 == mysql_session_track_get_first(mysql, SESSION_TRACK_SYSTEM_VARIABLES, &name, &name_length))
+    do
+    {
+      session_var_changed(st, name, name_length);
+      if (mysql_session_track_get_next(mysql, SESSION_TRACK_SYSTEM_VARIABLES, &data, &length))
+        break;
+    } while (0 == mysql_session_track_get_next(mysql, SESSION_TRACK_SYSTEM_VARIABLES, &name, &name_length));
+#else
+  (void)mysql; (void)st;
+#endif
+}
+
+/* remember the widest row of a stored result, bounded by the column
+ * max_lengths that mysql_store_result already computed: they may come from
+ * different rows, but measuring the rows would cost a pass over every
+ * result for the sake of auto_tune.
+ */
+
+static void
+session_record(struct session *st, MYSQL_RES *res)
+{
+  MYSQL_FIELD *f;
+  unsigned int i, n;
+  unsigned long bound = 0;
+
+  if (!res || mysql_num_rows(res) == 0)
+    return;
+  n = mysql_num_fields(res);
+  f = mysql_fetch_fields(res);
+  for (i = 0; i < n; i++)
+    bound += f[i].max_length + 1; /* length prefix */
+  if (bound > st->max_row)
+    st->max_row = bound;
+}
+
+/* does the statement sql start with the (upper case) keyword kw?  Leading
+ * comments are skipped, the text of version comments is looked at.
+ */
+
+static int
+statement_is(const char *sql, size_t len, const char *kw)
+{
+  size_t i = 0, k;
+
+  for (;;)
+  {
+    while (i < len && (isspace((unsigned char)sql[i]) || sql[i] == '('))
+      i++;
+    if (i + 2 < len && sql[i] == '/' && sql[i+1] == '*' && sql[i+2] == '!')
+    {
+      for (i += 3; i < len && isdigit((unsigned char)sql[i]); i++)
+        ;
+    }
+    else if (i + 1 < len && sql[i] == '/' && sql[i+1] == '*')
+    {
+      for (i += 2; i + 1 < len && !(sql[i] == '*' && sql[i+1] == '/'); i++)
+        ;
+      i += 2;
+    }
+    else if ((i < len && sql[i] == '#') || (i + 1 < len && sql[i] == '-' && sql[i+1] == '-'))
+    {
+      while (i < len && sql[i] != '\n')
+        i++;
+    }
+    else
+      break;
+  }
+  for (k = 0; kw[k]; k++, i++)
+    if (i >= len || toupper((unsigned char)sql[i]) != kw[k])
+      return 0;
+  return i >= len || !(isalnum((unsigned char)sql[i]) || sql[i] == '_');
+}
+
+/* forget what the statement sql may have changed */
+
+static void
+session_exec(struct session *st, const char *sql, size_t len)
+{
+  if (statement_is(sql, len, "USE"))
+    session_set(&st->schema, NULL, 0);
+  else if (statement_is(sql, len, "SET") || statement_is(sql, len, "CALL")
+           || statement_is(sql, len, "EXECUTE"))
+    session_clear(st, 1);
+}
+
 static void
 conn_finalize(value dbd)
 {
@@ -176,6 +486,7 @@ conn_finalize(value dbd)
     mysql_close(db);
     caml_leave_blocking_section();
   }
+  session_free(DBDsession(dbd));
 }
 
 /* db_connect opens a data base connection and returns an abstract
@@ -191,11 +502,49 @@ static unsigned int ml_mysql_protocol_type[] = {
 #define SET_OPTION_BOOL(option) option_bool = Bool_val(v); SET_OPTION(option, &option_bool)
 #define SET_OPTION_INT(option) option_int = Int_val(v); SET_OPTION(option, &option_int)
 #define SET_OPTION_STR(option) SET_OPTION(option, String_val(v))
+#define SET_OPTION_ULONG(option) option_ulong = Long_val(v); SET_OPTION(option, &option_ulong)
 #define SET_CLIENT_FLAG(flag) client_flag |= flag; break
 
-EXTERNAL value
-db_connect(value options, value args)
+/* enable TCP keepalive on the connection socket, the first probe being sent
+ * after idle seconds.  Not an error on sockets other than TCP.
+ */
+
+static my_socket
+conn_socket(MYSQL *mysql)
+{
+#if HAVE_DECL_MYSQL_GET_SOCKET
+  return mysql_get_socket(mysql);
+#else
+  return mysql->net.fd;
+#endif
+}
+
+static void
+set_keepalive(MYSQL *mysql, int idle)
+{
+#if !defined(_WIN32)
+  int on = 1;
+  my_socket fd = conn_socket(mysql);
+
+  if (0 != setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on))
+    return;
+#if defined(TCP_KEEPIDLE)
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+#elif defined(TCP_KEEPALIVE)
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof idle);
+#endif
+#else
+  (void)mysql; (void)idle;
+#endif
+}
+
+/*
+ * connect_gen -- db_connect, with the non-blocking client API when async
+ * (the connections of Mysql.Mux).
+ */
 
+static value
+connect_gen(value options, value args, int async)
 {
   CAMLparam2(options, args);
   CAMLlocal2(res, v);
@@ -207,10 +556,21 @@ db_connect(value options, value args)
   char *socket    = NULL;
   MYSQL *init;
   MYSQL *mysql;
+  struct session *st = NULL;
   unsigned int option_int;
+#if HAVE_DECL_MYSQL_OPT_MAX_ALLOWED_PACKET || HAVE_DECL_MYSQL_OPT_NET_BUFFER_LENGTH
+  unsigned long option_ulong;
+#endif
   my_bool option_bool;
   unsigned long client_flag = 0;
-
+  int keepalive = -1;
+  unsigned int connect_timeout = 0;
+#if ML_MUX
+  int timed_out = 0;
+#else
+  (void)async;                  /* no non-blocking connect to choose */
+  (void)connect_timeout;
+#endif
   init = mysql_init(NULL);
   if (!init)
   {
@@ -231,7 +591,7 @@ db_connect(value options, value args)
           case  3: SET_OPTION_BOOL(REPORT_DATA_TRUNCATION);
           case  4: SET_OPTION_BOOL(SECURE_AUTH);
           case  5: SET_OPTION(OPT_PROTOCOL, &ml_mysql_protocol_type[Int_val(v)]);
-          case  6: SET_OPTION_INT(OPT_CONNECT_TIMEOUT);
+          case  6: connect_timeout = Int_val(v); SET_OPTION_INT(OPT_CONNECT_TIMEOUT);
           case  7: SET_OPTION_INT(OPT_READ_TIMEOUT);
           case  8: SET_OPTION_INT(OPT_WRITE_TIMEOUT);
           case  9: SET_OPTION_STR(INIT_COMMAND);
@@ -240,6 +600,32 @@ db_connect(value options, value args)
           case 12: SET_OPTION_STR(SET_CHARSET_DIR);
           case 13: SET_OPTION_STR(SET_CHARSET_NAME);
           case 14: SET_OPTION_STR(SHARED_MEMORY_BASE_NAME);
+#if HAVE_DECL_MYSQL_OPT_COMPRESSION_ALGORITHMS
+          case 15: SET_OPTION_STR(OPT_COMPRESSION_ALGORITHMS);
+#else
+          case 15: mysqlfailwith("Mysql.connect: OPT_COMPRESSION_ALGORITHMS is not supported by the client library");
+#endif
+#if HAVE_DECL_MYSQL_OPT_ZSTD_COMPRESSION_LEVEL
+          case 16: SET_OPTION_INT(OPT_ZSTD_COMPRESSION_LEVEL);
+#else
+          case 16: mysqlfailwith("Mysql.connect: OPT_ZSTD_COMPRESSION_LEVEL is not supported by the client library");
+#endif
+#if HAVE_DECL_MYSQL_OPT_MAX_ALLOWED_PACKET
+          case 17: SET_OPTION_ULONG(OPT_MAX_ALLOWED_PACKET);
+#else
+          case 17: mysqlfailwith("Mysql.connect: OPT_MAX_ALLOWED_PACKET is not supported by the client library");
+#endif
+#if HAVE_DECL_MYSQL_OPT_NET_BUFFER_LENGTH
+          case 18: SET_OPTION_ULONG(OPT_NET_BUFFER_LENGTH);
+#else
+          case 18: mysqlfailwith("Mysql.connect: OPT_NET_BUFFER_LENGTH is not supported by the client library");
+#endif
+#if HAVE_DECL_MYSQL_OPT_BIND
+          case 19: SET_OPTION_STR(OPT_BIND);
+#else
+          case 19: mysqlfailwith("Mysql.connect: OPT_BIND is not supported by the client library");
+#endif
+          case 20: keepalive = Int_val(v); break;
           default:
             caml_invalid_argument("Mysql.connect: unknown option");
         }
@@ -251,6 +637,14 @@ db_connect(value options, value args)
           case 0: SET_OPTION(OPT_COMPRESS, NULL);
           case 1: SET_OPTION(OPT_NAMED_PIPE, NULL);
           case 2: SET_CLIENT_FLAG(CLIENT_FOUND_ROWS);
+          case 3:
+#if defined(CLIENT_SESSION_TRACK)
+            SET_CLIENT_FLAG(CLIENT_SESSION_TRACK);
+#elif defined(CLIENT_SESSION_TRACKING)
+            SET_CLIENT_FLAG(CLIENT_SESSION_TRACKING);
+#else
+            mysqlfailwith("Mysql.connect: OPT_SESSION_TRACK is not supported by the client library");
+#endif
           default: caml_invalid_argument("Mysql.connect: unknown option");
         }
       }
@@ -265,27 +659,89 @@ db_connect(value options, value args)
     socket    = strdup_option(Field(args,5));
 
     caml_enter_blocking_section();
+#if ML_MUX
+    if (async)
+    {
+      enum net_async_status status;
+      struct pollfd p;
+      struct timespec start, now;
+      long long limit;
+
+      if (connect_timeout == 0)
+        connect_timeout = MUX_CONNECT_TIMEOUT;
+      limit = 1000LL * connect_timeout;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while ((status = mysql_real_connect_nonblocking(init, host, user, pwd, db, port,
+                                                      socket, client_flag))
+             == NET_ASYNC_NOT_READY)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000LL
+            + (now.tv_nsec - start.tv_nsec) / 1000000 >= limit)
+        {
+          timed_out = 1;
+          break;
+        }
+        p.fd = conn_socket(init); /* -1 before the socket exists: a sleep */
+        p.events = POLLIN | POLLOUT;
+        poll(&p, 1, 10);
+      }
+      mysql = status == NET_ASYNC_COMPLETE ? init : NULL;
+    }
+    else
+#endif
     mysql = mysql_real_connect(init ,host ,user
                                ,pwd ,db ,port
                                ,socket, client_flag);
     caml_leave_blocking_section();
 
+    if (mysql)
+    {
+      if (keepalive >= 0)
+        set_keepalive(mysql, keepalive);
+      if ((st = calloc(1, sizeof *st)) != NULL)
+      {
+        st->thread = mysql_thread_id(mysql);
+        if (db)
+          st->schema = strdup(db); /* NULL, unknown, if that fails */
+      }
+    }
+
     free(host); free(db); free(pwd); free(user); free(socket);
 
     if (!mysql)
     {
+#if ML_MUX
+      if (timed_out)
+      {
+        mysql_close(init);
+        mysqlfailmsg("Mysql.connect: not connected after %u seconds", connect_timeout);
+      }
+#endif
       mysqlfailwith((char*)mysql_error(init));
     }
+    else if (!st)
+    {
+      mysql_close(mysql);
+      caml_raise_out_of_memory();
+    }
     else
     {
-      res = caml_alloc_final(3, conn_finalize, 0, 1);
+      res = caml_alloc_final(4, conn_finalize, 0, 1);
       Field(res, 1) = (value)mysql;
       Field(res, 2) =  Val_true;
+      Field(res, 3) = (value)st;
     }
   }
   CAMLreturn(res);
 }
 
+EXTERNAL value
+db_connect(value options, value args)
+{
+  return connect_gen(options, args, 0);
+}
+
 
 EXTERNAL value
 db_change_user(value v_dbd, value args)
@@ -306,6 +762,7 @@ db_change_user(value v_dbd, value args)
 
   free(db); free(pwd); free(user);
 
+  session_clear(DBDsession(v_dbd), 0);
   if (ret)
     mysqlfailmsg("Mysql.change_user: %s", mysql_error(mysql));
 
@@ -357,17 +814,27 @@ db_select_db(value v_dbd, value v_newdb)
 {
   CAMLparam2(v_dbd,v_newdb);
   MYSQL* mysql = check_db(v_dbd, "select_db");
-  char* newdb = strdup(String_val(v_newdb));
+  struct session *st = session_of(v_dbd);
+  char* newdb;
   my_bool ret;
 
+  if (st->schema && 0 == strcmp(st->schema, String_val(v_newdb)))
+    CAMLreturn(Val_unit);
+
+  newdb = strdup(String_val(v_newdb));
   caml_enter_blocking_section();
   ret = mysql_select_db(mysql, newdb);
   caml_leave_blocking_section();
 
-  free(newdb);
-
+  st = session_of(v_dbd);
   if (ret)
+  {
+    free(newdb);
+    session_set(&st->schema, NULL, 0);
     mysqlfailmsg("Mysql.select_db: %s", mysql_error(mysql));
+  }
+  free(st->schema);
+  st->schema = newdb;
 
   CAMLreturn(Val_unit);
 }
@@ -376,6 +843,17 @@ db_select_db(value v_dbd, value v_newdb)
  * db_disconnect closes a db connection and marks the dbd closed.
  */
 
+/* dbd_closed -- forgets the connection of dbd once mysql_close is done */
+
+static void
+dbd_closed(value dbd)
+{
+  session_free(DBDsession(dbd));
+  Field(dbd, 1) = Val_false;
+  Field(dbd, 2) = Val_false; /* Mark closed */
+  Field(dbd, 3) = (value)NULL;
+}
+
 EXTERNAL value
 db_disconnect(value dbd)
 {
@@ -384,8 +862,7 @@ db_disconnect(value dbd)
   caml_enter_blocking_section();
   mysql_close(db);
   caml_leave_blocking_section();
-  Field(dbd, 1) = Val_false;
-  Field(dbd, 2) = Val_false; /* Mark closed */
+  dbd_closed(dbd);
   CAMLreturn(Val_unit);
 }
 
@@ -406,123 +883,1763 @@ db_ping(value dbd)
   CAMLreturn(Val_unit);
 }
 
-/*
- * finalize -- this is called when a data base result is garbage
- * collected -- frees memory allocated by MySQL.
+/* COM_CHANGE_USER with the current credentials, which also resets the
+ * session but authenticates again
  */
 
-static void
-res_finalize(value result)
+static int
+change_user_same(MYSQL *db)
 {
-  MYSQL_RES *res = RESval(result);
-  if (res)
-    mysql_free_result(res);
-}
+  /* mysql_change_user replaces these fields, work on copies */
+  char *user = db->user ? strdup(db->user) : NULL;
+  char *pwd = db->passwd ? strdup(db->passwd) : NULL;
+  char *name = db->db ? strdup(db->db) : NULL;
+  int ret;
 
+  caml_enter_blocking_section();
+  ret = mysql_change_user(db, user, pwd, name);
+  caml_leave_blocking_section();
 
-struct custom_operations res_ops = {
-  "Mysql Query Results",
-  res_finalize,
-  custom_compare_default,
-  custom_hash_default,
-  custom_serialize_default,
-  custom_deserialize_default,
-#if defined(custom_compare_ext_default)
-  custom_compare_ext_default,
-#endif
-};
+  free(user); free(pwd); free(name);
+  return ret;
+}
+
+/* the server does not know COM_RESET_CONNECTION (MySQL before 5.7.3,
+ * MariaDB before 10.2.4)
+ */
+#define ML_ER_UNKNOWN_COM_ERROR 1047
 
 /*
- * db_exec -- execute a SQL query or command.  Returns a handle to
- * access the result.
+ * db_reset -- clears the session state (temporary tables, user variables,
+ * prepared statements, open transaction) without a new authentication.
+ * Older client libraries and servers fall back to COM_CHANGE_USER with the
+ * current credentials.
  */
 
 EXTERNAL value
-db_exec(value v_dbd, value v_sql)
+db_reset(value dbd)
 {
-  CAMLparam2(v_dbd, v_sql);
-  CAMLlocal1(res);
-  MYSQL *mysql = check_db(v_dbd,"exec");
-  char* sql = strdup(String_val(v_sql));
-  size_t len = caml_string_length(v_sql);
+  CAMLparam1(dbd);
+  MYSQL* db = check_db(dbd,"reset");
   int ret;
-
+#if HAVE_DECL_MYSQL_RESET_CONNECTION
   caml_enter_blocking_section();
-  ret = mysql_real_query(mysql, sql, len);
+  ret = mysql_reset_connection(db);
   caml_leave_blocking_section();
-
-  free(sql);
-
+  if (ret && mysql_errno(db) == ML_ER_UNKNOWN_COM_ERROR)
+    ret = change_user_same(db);
+#else
+  ret = change_user_same(db);
+#endif
+  /* the default database is kept */
+  session_clear(session_of(dbd), !ret);
   if (ret)
-  {
-    mysqlfailmsg("Mysql.exec: %s", mysql_error(mysql));
-  }
-  else
-  {
-    res = caml_alloc_custom(&res_ops, sizeof(MYSQL_RES*), 0, 1);
-    RESval(res) = mysql_store_result(mysql);
-  }
+    mysqlfailmsg("Mysql.reset: %s", mysql_error(db));
 
-  CAMLreturn(res);
+  CAMLreturn(Val_unit);
 }
 
 /*
- * db_fetch -- fetch one result tuple, represented as array of string
- * options.  In case a value is Null, the respective value is None.
- * Returns (Some v) in case there is such a result and None otherwise.
- * Moves the internal result cursor to the next tuple.
+ * Spilled results (Mysql.exec_spill, result limits).  The rows are
+ * drained from the server with mysql_use_result into memory or into an
+ * unlinked temporary file, which is then mapped.  A row is its cells in
+ * order, each a 4 byte length (SPILL_NULL for NULL) followed by the bytes
+ * and a NUL, so that a cell reads like one of mysql_fetch_row; the rows
+ * are followed by their offsets, 8 byte aligned.
  */
 
-EXTERNAL value
-db_fetch (value result)
+#define SPILL_NULL 0xFFFFFFFFu
+
+struct spill {
+  char *map;                    /* the rows, NULL when empty */
+  size_t size;
+  int mapped;                   /* map is a file mapping, else malloc'd */
+  const unsigned long long *rows; /* row offsets, count entries */
+  my_ulonglong count;
+  my_ulonglong cursor;          /* next row to fetch */
+  unsigned int ncols;
+  MYSQL_ROW row;                /* the current row, pointing into map */
+  unsigned long *lengths;       /* and the lengths of its cells */
+  my_ulonglong current;         /* its number, count when there is none */
+};
+
+static void
+spill_free(struct spill *sp)
 {
-  CAMLparam1(result);
-  CAMLlocal2(fields, s);
-  unsigned int i, n;
-  unsigned long *length;  /* array of long */
-  MYSQL_RES *res;
-  MYSQL_ROW row;
+#if !defined(_WIN32)
+  if (sp->mapped)
+    munmap(sp->map, sp->size);
+  else
+#endif
+    free(sp->map);
+  free(sp->row);
+  free(sp->lengths);
+  free(sp);
+}
 
-  res = RESval(result);
-  if (!res)
-    mysqlfailwith("Mysql.fetch: result did not return fetchable data");
+/* spill_row -- the cells of row i of sp into row and lengths */
 
-  n = mysql_num_fields(res);
+static void
+spill_row(const struct spill *sp, my_ulonglong i, MYSQL_ROW row, unsigned long *lengths)
+{
+  const char *p = sp->map + sp->rows[i];
+  unsigned int k;
+  uint32_t n;
+
+  for (k = 0; k < sp->ncols; k++) {
+    memcpy(&n, p, sizeof n);
+    p += sizeof n;
+    if (n == SPILL_NULL) {
+      row[k] = NULL;
+      lengths[k] = 0;
+    }
+    else {
+      row[k] = (char*)p;
+      lengths[k] = n;
+      p += n + 1;
+    }
+  }
+}
+
+/*
+ * The rows of a result, stored or spilled, as mysql_fetch_row and the
+ * other cursor functions give them.  A row position is a MYSQL_ROW_OFFSET,
+ * or for a spill the address of the offset of the row.
+ */
+
+typedef void *row_pos;
+
+/* the cursor and the current row of a result, see result_restore */
+
+struct result_mark {
+  row_pos pos;
+  MYSQL_ROW current;            /* stored */
+  my_ulonglong row;             /* spilled */
+};
+
+static my_ulonglong
+result_rows(struct result *r)
+{
+  return r->spill ? r->spill->count : mysql_num_rows(r->res);
+}
+
+static MYSQL_ROW
+result_fetch(struct result *r)
+{
+  struct spill *sp = r->spill;
+
+  if (!sp)
+    return mysql_fetch_row(r->res);
+  if (sp->cursor >= sp->count) {
+    sp->current = sp->count;
+    return NULL;
+  }
+  sp->current = sp->cursor++;
+  spill_row(sp, sp->current, sp->row, sp->lengths);
+  return sp->row;
+}
+
+/* the row of the last result_fetch, NULL before the first and at the end */
+
+static MYSQL_ROW
+result_current(struct result *r)
+{
+  if (!r->spill)
+    return r->res->current_row;
+  return r->spill->current < r->spill->count ? r->spill->row : NULL;
+}
+
+static unsigned long*
+result_lengths(struct result *r)
+{
+  return r->spill ? r->spill->lengths : mysql_fetch_lengths(r->res);
+}
+
+static row_pos
+result_tell(struct result *r)
+{
+  struct spill *sp = r->spill;
+
+  if (!sp)
+    return mysql_row_tell(r->res);
+  return sp->rows ? (row_pos)(sp->rows + sp->cursor) : NULL;
+}
+
+static void
+result_seek(struct result *r, row_pos pos)
+{
+  struct spill *sp = r->spill;
+
+  if (!sp)
+    mysql_row_seek(r->res, (MYSQL_ROW_OFFSET)pos);
+  else
+    sp->cursor = pos ? (my_ulonglong)((const unsigned long long*)pos - sp->rows) : 0;
+}
+
+static void
+result_data_seek(struct result *r, my_ulonglong n)
+{
+  if (r->spill)
+    r->spill->cursor = n;
+  else
+    mysql_data_seek(r->res, n);
+}
+
+static void
+result_mark(struct result *r, struct result_mark *m)
+{
+  m->pos = result_tell(r);
+  m->current = r->spill ? NULL : r->res->current_row;
+  m->row = r->spill ? r->spill->current : 0;
+}
+
+/* back to the mark: the cursor, the current row and its lengths */
+
+static void
+result_restore(struct result *r, const struct result_mark *m)
+{
+  struct spill *sp = r->spill;
+
+  result_seek(r, m->pos);
+  if (sp) {
+    sp->current = m->row;
+    if (m->row < sp->count)
+      spill_row(sp, m->row, sp->row, sp->lengths);
+  }
+  else {
+    r->res->current_row = m->current;
+    if (m->current)
+      mysql_fetch_lengths(r->res);
+  }
+}
+
+#if !defined(_WIN32)
+
+#define SPILL_ROWS  (-1)        /* spill_write: max_rows exceeded */
+#define SPILL_BYTES (-2)        /* spill_write: max_bytes exceeded */
+
+/* where spill_write puts the rows: a growing buffer until f is opened */
+
+struct sink {
+  FILE *f;
+  char *buf;
+  size_t cap;
+  unsigned long long pos;
+  char path[4096];              /* mkstemp template for f */
+};
+
+/* sink_put -- append n bytes, returns 0 or an errno value */
+
+static int
+sink_put(struct sink *out, const void *p, size_t n)
+{
+  if (n == 0)
+    return 0;
+  if (out->f) {
+    if (fwrite(p, 1, n, out->f) != n)
+      return errno ? errno : EIO;
+  }
+  else {
+    if (out->pos + n > out->cap) {
+      size_t cap = out->cap ? out->cap : 65536;
+      char *buf;
+
+      while (cap < out->pos + n)
+        cap *= 2;
+      if ((buf = realloc(out->buf, cap)) == NULL)
+        return ENOMEM;
+      out->buf = buf;
+      out->cap = cap;
+    }
+    memcpy(out->buf + out->pos, p, n);
+  }
+  out->pos += n;
+  return 0;
+}
+
+/* sink_open -- moves what was written so far to a new temporary file */
+
+static int
+sink_open(struct sink *out)
+{
+  int fd, err;
+
+  if ((fd = mkstemp(out->path)) < 0)
+    return errno;
+  unlink(out->path);            /* gone with the last reference */
+  if ((out->f = fdopen(fd, "w+b")) == NULL) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  setvbuf(out->f, NULL, _IOFBF, 1 << 20);
+  if (out->pos > 0 && fwrite(out->buf, 1, out->pos, out->f) != out->pos)
+    return errno ? errno : EIO;
+  free(out->buf);
+  out->buf = NULL;
+  out->cap = 0;
+  return 0;
+}
+
+static void
+sink_close(struct sink *out)
+{
+  if (out->f)
+    fclose(out->f);             /* a mapping of it stays valid */
+  free(out->buf);
+}
+
+/*
+ * spill_write -- drains the rows of the unbuffered result r into out and
+ * hands them to sp.  Runs without the runtime lock.  While out is in
+ * memory, the rows and bytes are checked against lim after every row:
+ * past a limit the rows go on into a file when lim->spill, otherwise the
+ * result is given up.  Returns 0, SPILL_ROWS, SPILL_BYTES or an errno
+ * value; the server error, if any, is left in the connection.
+ */
+
+static int
+spill_write(MYSQL *mysql, MYSQL_RES *r, struct sink *out,
+            const struct limits *lim, struct spill *sp, unsigned long *width)
+{
+  unsigned int i, n = mysql_num_fields(r);
+  unsigned long long *rows = NULL, *p;
+  my_ulonglong cap = 0;
+  unsigned long *lengths, w;
+  uint32_t len;
+  MYSQL_ROW row;
+  int err = 0;
+
+  while (!err && (row = mysql_fetch_row(r)) != NULL) {
+    if (sp->count == cap) {
+      cap = cap ? 2 * cap : 1024;
+      if ((p = realloc(rows, cap * sizeof *rows)) == NULL) {
+        err = ENOMEM;
+        break;
+      }
+      rows = p;
+    }
+    rows[sp->count++] = out->pos;
+    lengths = mysql_fetch_lengths(r);
+    for (i = 0, w = 0; i < n && !err; i++) {
+      len = row[i] ? (uint32_t)lengths[i] : SPILL_NULL;
+      w += lengths[i] + 1;
+      err = sink_put(out, &len, sizeof len);
+      if (!err && row[i])
+        err = sink_put(out, row[i], lengths[i]);
+      if (!err && row[i])
+        err = sink_put(out, "", 1);
+    }
+    if (w > *width)
+      *width = w;
+
+    if (!err && !out->f) {
+      if (lim->rows && sp->count > lim->rows)
+        err = lim->spill ? sink_open(out) : SPILL_ROWS;
+      else if (lim->bytes && out->pos + sp->count * sizeof *rows > lim->bytes)
+        err = lim->spill ? sink_open(out) : SPILL_BYTES;
+    }
+  }
+
+  if (!err && !mysql_errno(mysql) && sp->count > 0) {
+    static const char pad[8];
+
+    err = sink_put(out, pad, (8 - out->pos % 8) % 8);
+    if (!err)
+      err = sink_put(out, rows, sp->count * sizeof *rows);
+    if (!err && out->f) {
+      if (fflush(out->f) != 0)
+        err = errno ? errno : EIO;
+      else if ((sp->map = mmap(NULL, out->pos, PROT_READ, MAP_SHARED,
+                               fileno(out->f), 0)) == MAP_FAILED) {
+        sp->map = NULL;
+        err = errno;
+      }
+      else
+        sp->mapped = 1;
+    }
+    else if (!err) {
+      sp->map = out->buf;
+      out->buf = NULL;
+    }
+    if (!err) {
+      sp->size = out->pos;
+      sp->rows = (const unsigned long long*)
+        (sp->map + sp->size - sp->count * sizeof *rows);
+    }
+  }
+  free(rows);
+  return err;
+}
+
+#endif
+
+/*
+ * finalize -- this is called when a data base result is garbage
+ * collected -- frees memory allocated by MySQL.
+ */
+
+static void
+res_finalize(value result)
+{
+  MYSQL_RES *res = RESval(result);
+  if (res)
+    mysql_free_result(res);
+  if (SPILLval(result))
+    spill_free(SPILLval(result));
+}
+
+
+struct custom_operations res_ops = {
+  "Mysql Query Results",
+  res_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/*
+ * db_exec -- execute a SQL query or command.  Returns a handle to
+ * access the result.  With result limits set on the connection, the
+ * rows are streamed as by exec_streamed below.
+ */
+
+static value exec_streamed(value v_dbd, value v_sql, const struct limits *lim,
+                           int to_file, const char *fun);
+
+static value
+exec_stored(value v_dbd, value v_sql)
+{
+  CAMLparam2(v_dbd, v_sql);
+  CAMLlocal1(res);
+  MYSQL *mysql = check_db(v_dbd,"exec");
+  char* sql = strdup(String_val(v_sql));
+  size_t len = caml_string_length(v_sql);
+  struct session *st;
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, len);
+  caml_leave_blocking_section();
+
+  st = session_of(v_dbd);
+  session_exec(st, sql, len);
+  free(sql);
+
+  if (ret)
+  {
+    mysqlfailmsg("Mysql.exec: %s", mysql_error(mysql));
+  }
+  else
+  {
+    res = caml_alloc_custom(&res_ops, sizeof(struct result), 0, 1);
+    SPILLval(res) = NULL;
+    RESval(res) = mysql_store_result(mysql);
+    session_track(mysql, st);
+    session_record(st, RESval(res));
+  }
+
+  CAMLreturn(res);
+}
+
+EXTERNAL value
+db_exec(value v_dbd, value v_sql)
+{
+  struct limits lim;
+
+  check_db(v_dbd,"exec");
+  lim = DBDsession(v_dbd)->limits;
+  if (lim.rows || lim.bytes)
+    return exec_streamed(v_dbd, v_sql, &lim, 0, "Mysql.exec");
+  return exec_stored(v_dbd, v_sql);
+}
+
+/*
+ * exec_streamed -- runs sql and streams its rows into a spill, in memory
+ * under the limits lim, in a file (from the start when to_file) past them.
+ * The connection is free again when this returns.  When a limit is passed
+ * and the result is given up, the connection is closed rather than the
+ * rest of the rows read: the server ends the statement once it can no
+ * longer send them, and dbd is left disconnected.
+ */
+
+static value
+exec_streamed(value v_dbd, value v_sql, const struct limits *lim,
+              int to_file, const char *fun)
+{
+  CAMLparam2(v_dbd, v_sql);
+  CAMLlocal1(res);
+#if defined(_WIN32)
+  mysqlfailmsg("%s: streamed results are not supported on this platform", fun);
+#else
+  MYSQL *mysql = check_db(v_dbd,"exec");
+  char* sql = strdup(String_val(v_sql));
+  size_t len = caml_string_length(v_sql);
+  const char *dir = lim->dir ? lim->dir : getenv("TMPDIR");
+  struct sink out = { NULL, NULL, 0, 0, "" };
+  struct session *st;
+  struct spill *sp;
+  MYSQL_RES *r = NULL;
+  unsigned long width = 0;
+  unsigned int n;
+  int ret, err = 0, closed = 0;
+
+  snprintf(out.path, sizeof out.path, "%s/ocaml-mysql-spill-XXXXXX",
+           dir && *dir ? dir : "/tmp");
+  res = caml_alloc_custom(&res_ops, sizeof(struct result), 0, 1);
+  RESval(res) = NULL;
+  SPILLval(res) = NULL;
+  if ((sp = calloc(1, sizeof *sp)) == NULL)
+    caml_raise_out_of_memory();
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, len);
+  if (!ret && (r = mysql_use_result(mysql)) != NULL) {
+    n = mysql_num_fields(r);
+    sp->ncols = n;
+    sp->row = malloc((n ? n : 1) * sizeof(char*));
+    sp->lengths = malloc((n ? n : 1) * sizeof(unsigned long));
+    if (!sp->row || !sp->lengths)
+      err = ENOMEM;
+    if (!err && to_file)
+      err = sink_open(&out);
+    if (!err)
+      err = spill_write(mysql, r, &out, lim, sp, &width);
+    sink_close(&out);
+    sp->current = sp->count;
+    if (err == SPILL_ROWS || err == SPILL_BYTES) {
+      /* mysql_free_result would read the rest of the rows: the result is
+       * detached from the connection, which is closed first */
+      r->handle = NULL;
+      mysql_close(mysql);
+      mysql_free_result(r);
+      r = NULL;
+      closed = 1;
+    }
+    else if (err || mysql_errno(mysql)) {
+      ret = !err;
+      mysql_free_result(r);     /* discards the rest of the rows */
+      r = NULL;
+    }
+  }
+  caml_leave_blocking_section();
+
+  if (closed) {
+    free(sql);
+    spill_free(sp);
+    dbd_closed(v_dbd);          /* lim->dir may be gone with it */
+    if (err == SPILL_ROWS)
+      mysqlfailmsg("%s: result exceeds max_rows (%llu), connection closed",
+                   fun, (unsigned long long)lim->rows);
+    mysqlfailmsg("%s: result exceeds max_bytes (%llu), connection closed",
+                 fun, lim->bytes);
+  }
+
+  st = session_of(v_dbd);
+  session_exec(st, sql, len);
+  free(sql);
+
+  if (ret || err) {
+    spill_free(sp);
+    if (err)
+      mysqlfailmsg("%s: spill: %s", fun, strerror(err));
+    mysqlfailmsg("%s: %s", fun, mysql_error(mysql));
+  }
+
+  session_track(mysql, st);
+  if (width > st->max_row)
+    st->max_row = width;
+
+  RESval(res) = r;
+  SPILLval(res) = r ? sp : NULL;
+  if (!r)
+    spill_free(sp);
+#endif
+  CAMLreturn(res);
+}
+
+/*
+ * dml_info -- the dml_info record of mysql.ml for the statement just run
+ * on mysql.  UPDATE reports matched and changed rows in mysql_info, for
+ * other statements both are the affected rows.
+ */
+
+static value
+dml_info(MYSQL *mysql, my_ulonglong affected, my_ulonglong insert_id)
+{
+  const char *info = mysql_info(mysql);
+  long matched = (long)affected, changed = (long)affected;
+  value v;
+
+  if (info && sscanf(info, "Rows matched: %ld Changed: %ld", &matched, &changed) != 2)
+    matched = changed = (long)affected;
+
+  v = caml_alloc_small(5, 0);
+  Field(v, 0) = Val_long((long)affected);
+  Field(v, 1) = Val_long((long)insert_id);
+  Field(v, 2) = Val_long(mysql_warning_count(mysql));
+  Field(v, 3) = Val_long(matched);
+  Field(v, 4) = Val_long(changed);
+  return v;
+}
+
+/*
+ * db_exec_dml -- executes a statement for its effect: returns the
+ * dml_info record instead of a result handle.  Rows the statement returns
+ * are discarded.
+ */
+
+EXTERNAL value
+db_exec_dml(value v_dbd, value v_sql)
+{
+  CAMLparam2(v_dbd, v_sql);
+  MYSQL *mysql = check_db(v_dbd,"exec_dml");
+  char* sql = strdup(String_val(v_sql));
+  size_t len = caml_string_length(v_sql);
+  struct session *st;
+  MYSQL_RES *r;
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, len);
+  if (!ret && (r = mysql_use_result(mysql)) != NULL)
+    mysql_free_result(r);       /* reads and drops the rows */
+  caml_leave_blocking_section();
+
+  st = session_of(v_dbd);
+  session_exec(st, sql, len);
+  free(sql);
+
+  if (ret || mysql_errno(mysql))
+    mysqlfailmsg("Mysql.exec_dml: %s", mysql_error(mysql));
+  session_track(mysql, st);
+
+  CAMLreturn(dml_info(mysql, mysql_affected_rows(mysql), mysql_insert_id(mysql)));
+}
+
+/*
+ * db_exec_spill -- like db_exec, but the rows are streamed into a spill
+ * file in dir (or $TMPDIR) instead of being stored in memory.
+ */
+
+EXTERNAL value
+db_exec_spill(value v_dir, value v_dbd, value v_sql)
+{
+  struct limits lim = { 0, 0, 1, NULL };
+
+  if (v_dir != Val_none)
+    lim.dir = (char*)String_val(Some_val(v_dir));
+  return exec_streamed(v_dbd, v_sql, &lim, 1, "Mysql.exec_spill");
+}
+
+/* the limits record of mysql.ml, its strings are not copied */
+
+static struct limits
+limits_val(value v)
+{
+  struct limits lim;
+
+  if (Long_val(Field(v, 0)) < 0 || Long_val(Field(v, 1)) < 0)
+    caml_invalid_argument("Mysql: negative result limit");
+  lim.rows = Long_val(Field(v, 0));
+  lim.bytes = Long_val(Field(v, 1));
+  lim.spill = Int_val(Field(v, 2));
+  lim.dir = Field(v, 3) == Val_none ? NULL : (char*)String_val(Some_val(Field(v, 3)));
+  return lim;
+}
+
+/*
+ * db_exec_limited -- db_exec under the given limits instead of those of
+ * the connection; without limits the result is stored as usual.
+ */
+
+EXTERNAL value
+db_exec_limited(value v_dbd, value v_sql, value v_lim)
+{
+  struct limits lim = limits_val(v_lim);
+
+  if (lim.rows || lim.bytes)
+    return exec_streamed(v_dbd, v_sql, &lim, 0, "Mysql.exec_limited");
+  return exec_stored(v_dbd, v_sql);
+}
+
+/* db_set_result_limits -- the limits db_exec applies on this connection */
+
+EXTERNAL value
+db_set_result_limits(value dbd, value v_lim)
+{
+  CAMLparam2(dbd, v_lim);
+  struct limits lim = limits_val(v_lim);
+  struct session *st;
+
+  check_db(dbd,"set_result_limits");
+#if defined(_WIN32)
+  if (lim.rows || lim.bytes)
+    mysqlfailwith("Mysql.set_result_limits: not supported on this platform");
+#endif
+  st = DBDsession(dbd);
+  free(st->limits.dir);
+  if (lim.dir && (lim.dir = strdup(lim.dir)) == NULL)
+    caml_raise_out_of_memory();
+  st->limits = lim;
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * db_fetch -- fetch one result tuple, represented as array of string
+ * options.  In case a value is Null, the respective value is None.
+ * Returns (Some v) in case there is such a result and None otherwise.
+ * Moves the internal result cursor to the next tuple.
+ */
+
+EXTERNAL value
+db_fetch (value result)
+{
+  CAMLparam1(result);
+  CAMLlocal2(fields, s);
+  unsigned int i, n;
+  unsigned long *length;  /* array of long */
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  res = RESval(result);
+  if (!res)
+    mysqlfailwith("Mysql.fetch: result did not return fetchable data");
+
+  n = mysql_num_fields(res);
+  if (n == 0)
+    mysqlfailwith("Mysql.fetch: no columns");
+
+  row = result_fetch(RESULTval(result));
+  if (!row)
+    CAMLreturn(Val_none);
+
+  /* create Some([| f1; f2; .. ;fn |]) */
+
+  length = result_lengths(RESULTval(result));      /* length[] */
+  fields = caml_alloc_tuple(n);                    /* array */
+  for (i=0;i<n;i++) {
+    s = val_str_option(row[i], length[i]);
+    Store_field(fields, i, s);
+  }
+
+  CAMLreturn(Val_some(fields));
+}
+
+/*
+ * projection -- the column positions of a cols argument, checked against
+ * the n columns of the result.  Returns the number of positions.
+ */
+
+static mlsize_t
+projection(value cols, unsigned int n, const char *fun)
+{
+  mlsize_t i, m = Wosize_val(cols);
+
+  for (i = 0; i < m; i++)
+    if (Long_val(Field(cols, i)) < 0 || Long_val(Field(cols, i)) >= (long)n)
+      caml_invalid_argument(fun);
+  return m;
+}
+
+/*
+ * db_fetch_cols -- like db_fetch, but only copies the columns at the
+ * positions given in cols.
+ */
+
+EXTERNAL value
+db_fetch_cols(value result, value cols)
+{
+  CAMLparam2(result, cols);
+  CAMLlocal2(fields, s);
+  mlsize_t i, m;
+  long c;
+  unsigned long *length;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  res = RESval(result);
+  if (!res)
+    mysqlfailwith("Mysql.fetch_cols: result did not return fetchable data");
+  m = projection(cols, mysql_num_fields(res), "Mysql.fetch_cols: column out of range");
+
+  row = result_fetch(RESULTval(result));
+  if (!row)
+    CAMLreturn(Val_none);
+
+  length = result_lengths(RESULTval(result));
+  fields = caml_alloc_tuple(m);
+  for (i = 0; i < m; i++) {
+    c = Long_val(Field(cols, i));
+    s = val_str_option(row[c], length[c]);
+    Store_field(fields, i, s);
+  }
+
+  CAMLreturn(Val_some(fields));
+}
+
+EXTERNAL value
+db_to_row(value result, value offset)
+{
+  int64_t off = Int64_val(offset);
+  MYSQL_RES *res;
+
+  res = RESval(result);
+  if (!res)
+    mysqlfailwith("Mysql.to_row: result did not return fetchable data");
+
+  if (off < 0 || off > (int64_t)result_rows(RESULTval(result))-1)
+    caml_invalid_argument("Mysql.to_row: offset out of range");
+
+  result_data_seek(RESULTval(result), off);
+
+  return Val_unit;
+}
+
+/*
+ * Typed access to the current row of a result (Mysql.Cell): db_next moves
+ * to the next row, the db_cell_* functions decode one of its cells without
+ * building the string option array of db_fetch.
+ */
+
+EXTERNAL value
+db_next(value result)
+{
+  MYSQL_RES *res = RESval(result);
+
+  if (!res)
+    mysqlfailwith("Mysql.Cell.next: result did not return fetchable data");
+  return Val_bool(result_fetch(RESULTval(result)) != NULL);
+}
+
+static const char*
+cell(value result, value v_i, unsigned long *len, const char *fun)
+{
+  MYSQL_RES *res = RESval(result);
+  long i = Long_val(v_i);
+  MYSQL_ROW row;
+
+  if (!res || (row = result_current(RESULTval(result))) == NULL)
+    mysqlfailmsg("Mysql.Cell.%s: no current row", fun);
+  if (i < 0 || i >= (long)mysql_num_fields(res))
+    caml_invalid_argument("Mysql.Cell: column out of range");
+  *len = result_lengths(RESULTval(result))[i];
+  return row[i];
+}
+
+static const char*
+cell_not_null(value result, value v_i, unsigned long *len, const char *fun)
+{
+  const char *s = cell(result, v_i, len, fun);
+
+  if (!s)
+    mysqlfailmsg("Mysql.Cell.%s: column %ld is NULL", fun, Long_val(v_i));
+  return s;
+}
+
+/* parse the whole of the cell text s, return 0 when it is not a number */
+
+static int
+parse_integer(const char *s, unsigned long len, long long *n)
+{
+  char *end;
+
+  errno = 0;
+  *n = strtoll(s, &end, 10);
+  return !errno && len > 0 && end == s + len;
+}
+
+static int
+parse_float(const char *s, unsigned long len, double *d)
+{
+  char *end;
+
+  *d = strtod(s, &end);
+  return len > 0 && end == s + len;
+}
+
+static long long
+cell_integer(value result, value v_i, const char *fun)
+{
+  unsigned long len;
+  const char *s = cell_not_null(result, v_i, &len, fun);
+  long long n;
+
+  if (!parse_integer(s, len, &n))
+    mysqlfailmsg("Mysql.Cell.%s: column %ld is not an integer", fun, Long_val(v_i));
+  return n;
+}
+
+EXTERNAL value
+db_cell_is_null(value result, value v_i)
+{
+  unsigned long len;
+  return Val_bool(cell(result, v_i, &len, "is_null") == NULL);
+}
+
+EXTERNAL value
+db_cell_int(value result, value v_i)
+{
+  long long n = cell_integer(result, v_i, "int");
+
+  if (n < Min_long || n > Max_long)
+    mysqlfailmsg("Mysql.Cell.int: column %ld does not fit in an int", Long_val(v_i));
+  return Val_long(n);
+}
+
+EXTERNAL value
+db_cell_int64(value result, value v_i)
+{
+  return caml_copy_int64(cell_integer(result, v_i, "int64"));
+}
+
+EXTERNAL value
+db_cell_float(value result, value v_i)
+{
+  unsigned long len;
+  const char *s = cell_not_null(result, v_i, &len, "float");
+  double d;
+
+  if (!parse_float(s, len, &d))
+    mysqlfailmsg("Mysql.Cell.float: column %ld is not a number", Long_val(v_i));
+  return caml_copy_double(d);
+}
+
+EXTERNAL value
+db_cell_string(value result, value v_i)
+{
+  CAMLparam2(result, v_i);
+  CAMLlocal1(v);
+  unsigned long len;
+  const char *s = cell_not_null(result, v_i, &len, "string");
+
+  v = caml_alloc_string(len);
+  memcpy((char*)String_val(v), s, len);
+  CAMLreturn(v);
+}
+
+/*
+ * Filters (Mysql.Filter.t) evaluated over the MYSQL_ROW data, so that only
+ * matching rows are copied into the heap.  The tags follow the order of
+ * the constructors.
+ */
+
+#define FILTER_EQ 0
+#define FILTER_PREFIX 1
+#define FILTER_RANGE 2
+#define FILTER_INT_RANGE 3
+#define FILTER_INT_ABOVE 4
+#define FILTER_INT_BELOW 5
+#define FILTER_NULL 6
+#define FILTER_AND 7
+#define FILTER_OR 8
+#define FILTER_NOT 9
+
+static void
+filter_check(value f, unsigned int n)
+{
+  switch (Tag_val(f))
+  {
+    case FILTER_AND:
+    case FILTER_OR:
+      filter_check(Field(f, 0), n);
+      filter_check(Field(f, 1), n);
+      break;
+    case FILTER_NOT:
+      filter_check(Field(f, 0), n);
+      break;
+    default:
+      if (Long_val(Field(f, 0)) < 0 || Long_val(Field(f, 0)) >= (long)n)
+        caml_invalid_argument("Mysql.Filter: column out of range");
+  }
+}
+
+/* byte-wise comparison of the cell s with the OCaml string v */
+
+static int
+compare_cell(const char *s, unsigned long len, value v)
+{
+  mlsize_t vlen = caml_string_length(v);
+  int c = memcmp(s, String_val(v), len < vlen ? len : vlen);
+
+  if (c != 0)
+    return c;
+  return len < vlen ? -1 : len > vlen ? 1 : 0;
+}
+
+static int
+filter_matches(value f, MYSQL_ROW row, unsigned long *length)
+{
+  const char *s;
+  unsigned long len;
+  long long n;
+
+  switch (Tag_val(f))
+  {
+    case FILTER_AND:
+      return filter_matches(Field(f, 0), row, length) && filter_matches(Field(f, 1), row, length);
+    case FILTER_OR:
+      return filter_matches(Field(f, 0), row, length) || filter_matches(Field(f, 1), row, length);
+    case FILTER_NOT:
+      return !filter_matches(Field(f, 0), row, length);
+    case FILTER_NULL:
+      return row[Long_val(Field(f, 0))] == NULL;
+  }
+
+  s = row[Long_val(Field(f, 0))];
+  len = length[Long_val(Field(f, 0))];
+  if (!s)
+    return 0;
+  switch (Tag_val(f))
+  {
+    case FILTER_EQ:
+      return len == caml_string_length(Field(f, 1)) && 0 == memcmp(s, String_val(Field(f, 1)), len);
+    case FILTER_PREFIX:
+      return len >= caml_string_length(Field(f, 1))
+        && 0 == memcmp(s, String_val(Field(f, 1)), caml_string_length(Field(f, 1)));
+    case FILTER_RANGE:
+      return compare_cell(s, len, Field(f, 1)) >= 0 && compare_cell(s, len, Field(f, 2)) <= 0;
+    case FILTER_INT_RANGE:
+      return parse_integer(s, len, &n)
+        && n >= Long_val(Field(f, 1)) && n <= Long_val(Field(f, 2));
+    case FILTER_INT_ABOVE:      /* the whole of BIGINT, past the int bounds */
+      return parse_integer(s, len, &n) && n > Long_val(Field(f, 1));
+    case FILTER_INT_BELOW:
+      return parse_integer(s, len, &n) && n < Long_val(Field(f, 1));
+  }
+  return 0;
+}
+
+/* the next row matching f, NULL at the end of the result */
+
+static MYSQL_ROW
+fetch_matching(struct result *r, value f)
+{
+  MYSQL_ROW row;
+
+  while ((row = result_fetch(r)) != NULL)
+    if (filter_matches(f, row, result_lengths(r)))
+      return row;
+  return NULL;
+}
+
+/*
+ * db_fetch_matching -- like db_fetch_cols (all the columns for None), for
+ * the next row matching the filter.
+ */
+
+EXTERNAL value
+db_fetch_matching(value result, value f, value cols)
+{
+  CAMLparam3(result, f, cols);
+  CAMLlocal2(fields, s);
+  mlsize_t i, m;
+  long c;
+  unsigned long *length;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  res = RESval(result);
+  if (!res)
+    mysqlfailwith("Mysql.Filter.fetch: result did not return fetchable data");
+  filter_check(f, mysql_num_fields(res));
+  m = Is_block(cols)
+    ? projection(Some_val(cols), mysql_num_fields(res), "Mysql.Filter.fetch: column out of range")
+    : mysql_num_fields(res);
+
+  row = fetch_matching(RESULTval(result), f);
+  if (!row)
+    CAMLreturn(Val_none);
+
+  length = result_lengths(RESULTval(result));
+  fields = caml_alloc_tuple(m);
+  for (i = 0; i < m; i++) {
+    c = Is_block(cols) ? Long_val(Field(Some_val(cols), i)) : (long)i;
+    s = val_str_option(row[c], length[c]);
+    Store_field(fields, i, s);
+  }
+
+  CAMLreturn(Val_some(fields));
+}
+
+/*
+ * db_count_matching -- counts the rows matching the filter from the
+ * current row on, without copying any of them.
+ */
+
+EXTERNAL value
+db_count_matching(value result, value f)
+{
+  MYSQL_RES *res = RESval(result);
+  long count = 0;
+
+  if (!res)
+    mysqlfailwith("Mysql.Filter.count: result did not return fetchable data");
+  filter_check(f, mysql_num_fields(res));
+  while (fetch_matching(RESULTval(result), f))
+    count++;
+  return Val_long(count);
+}
+
+/*
+ * Hash index over the rows of a result (Mysql.Index): an open addressing
+ * table of row positions, keyed by the bytes of some columns.  The rows
+ * themselves stay in the result, which the OCaml side keeps alive along
+ * with the index.
+ */
+
+struct hash_slot {
+  unsigned long long hash;
+  row_pos row;                  /* NULL for a free slot */
+};
+
+struct hash_index {
+  unsigned long mask;           /* number of slots - 1, a power of 2 */
+  mlsize_t ncols;
+  long *cols;
+  struct hash_slot *slots;
+};
+
+#define INDEXval(x) (*(struct hash_index**)Data_custom_val(x))
+
+static void
+index_finalize(value v)
+{
+  struct hash_index *ix = INDEXval(v);
+
+  if (ix)
+  {
+    free(ix->cols);
+    free(ix->slots);
+    free(ix);
+  }
+}
+
+struct custom_operations index_ops = {
+  "Mysql Result Index",
+  index_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+/* FNV-1a, the length of each part being hashed in too */
+
+static unsigned long long
+hash_bytes(unsigned long long h, const char *s, unsigned long len)
+{
+  unsigned long i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return (h ^ len) * 1099511628211ULL;
+}
+
+#define HASH_SEED 14695981039346656037ULL
+
+/* hash of the key columns of the current row, 0 if one of them is NULL */
+
+static int
+row_hash(struct hash_index *ix, MYSQL_ROW row, unsigned long *length, unsigned long long *h)
+{
+  mlsize_t i;
+
+  *h = HASH_SEED;
+  for (i = 0; i < ix->ncols; i++)
+  {
+    if (!row[ix->cols[i]])
+      return 0;
+    *h = hash_bytes(*h, row[ix->cols[i]], length[ix->cols[i]]);
+  }
+  return 1;
+}
+
+/* do the key columns of the row equal the strings of keys? */
+
+static int
+row_has_key(struct hash_index *ix, MYSQL_ROW row, unsigned long *length, value keys)
+{
+  mlsize_t i;
+  long c;
+
+  for (i = 0; i < ix->ncols; i++)
+  {
+    c = ix->cols[i];
+    if (!row[c] || length[c] != caml_string_length(Field(keys, i))
+        || 0 != memcmp(row[c], String_val(Field(keys, i)), length[c]))
+      return 0;
+  }
+  return 1;
+}
+
+static int
+rows_equal(struct hash_index *ix, MYSQL_ROW a, unsigned long *alen, MYSQL_ROW b, unsigned long *blen)
+{
+  mlsize_t i;
+  long c;
+
+  for (i = 0; i < ix->ncols; i++)
+  {
+    c = ix->cols[i];
+    if (alen[c] != blen[c] || 0 != memcmp(a[c], b[c], alen[c]))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * db_index_create -- indexes the rows of result on the columns at the
+ * positions in cols.  Rows with a NULL key are left out, the first of the
+ * rows sharing a key wins.  The current row of the result is kept.
+ */
+
+EXTERNAL value
+db_index_create(value result, value cols)
+{
+  CAMLparam2(result, cols);
+  CAMLlocal1(v);
+  MYSQL_RES *res = RESval(result);
+  struct result *r = RESULTval(result);
+  struct result_mark mark;
+  row_pos off;
+  MYSQL_ROW row, other, saved_row = NULL;
+  unsigned long *length, *other_length, *saved = NULL;
+  unsigned long long h;
+  unsigned long size = 8, k;
+  mlsize_t i, n;
+  struct hash_index *ix;
+
+  if (!res)
+    mysqlfailwith("Mysql.Index.create: result did not return fetchable data");
+  n = projection(cols, mysql_num_fields(res), "Mysql.Index.create: column out of range");
   if (n == 0)
-    mysqlfailwith("Mysql.fetch: no columns");
+    caml_invalid_argument("Mysql.Index.create: no column");
+  while (size < 2 * result_rows(r))
+    size *= 2;
+
+  ix = calloc(1, sizeof *ix);
+  if (!ix)
+    caml_raise_out_of_memory();
+  ix->mask = size - 1;
+  ix->ncols = n;
+  ix->cols = malloc(n * sizeof(long));
+  ix->slots = calloc(size, sizeof(struct hash_slot));
+  saved = malloc(mysql_num_fields(res) * sizeof(unsigned long));
+  saved_row = malloc(mysql_num_fields(res) * sizeof(char*));
+  if (!ix->cols || !ix->slots || !saved || !saved_row)
+  {
+    free(saved); free(saved_row);
+    free(ix->cols); free(ix->slots); free(ix);
+    caml_raise_out_of_memory();
+  }
+  for (i = 0; i < n; i++)
+    ix->cols[i] = Long_val(Field(cols, i));
+
+  result_mark(r, &mark);
+  result_data_seek(r, 0);
+  for (;;)
+  {
+    off = result_tell(r);
+    row = result_fetch(r);
+    if (!row)
+      break;
+    length = result_lengths(r);
+    if (!row_hash(ix, row, length, &h))
+      continue;
+    /* fetching another row may reuse the arrays of this one */
+    memcpy(saved, length, mysql_num_fields(res) * sizeof(unsigned long));
+    memcpy(saved_row, row, mysql_num_fields(res) * sizeof(char*));
+    for (k = h & ix->mask; ix->slots[k].row; k = (k + 1) & ix->mask)
+    {
+      if (ix->slots[k].hash != h)
+        continue;
+      /* same hash: a duplicate key or a collision */
+      result_seek(r, ix->slots[k].row);
+      other = result_fetch(r);
+      other_length = result_lengths(r);
+      if (rows_equal(ix, saved_row, saved, other, other_length))
+        break;
+    }
+    if (!ix->slots[k].row)
+    {
+      ix->slots[k].hash = h;
+      ix->slots[k].row = off;
+    }
+    result_seek(r, off);
+    result_fetch(r);
+  }
+  result_restore(r, &mark);
+  free(saved);
+  free(saved_row);
+
+  v = caml_alloc_custom(&index_ops, sizeof(struct hash_index*), 0, 1);
+  INDEXval(v) = ix;
+  CAMLreturn(v);
+}
+
+/*
+ * db_index_lookup -- the row of result whose key columns equal keys, like
+ * db_fetch_cols (all the columns for None).  The current row of the
+ * result is kept.
+ */
+
+EXTERNAL value
+db_index_lookup(value result, value index, value keys, value cols)
+{
+  CAMLparam4(result, index, keys, cols);
+  CAMLlocal4(fields, s, lengths, cells);
+  MYSQL_RES *res = RESval(result);
+  struct result *r = RESULTval(result);
+  struct hash_index *ix = INDEXval(index);
+  struct result_mark mark;
+  MYSQL_ROW row = NULL;
+  unsigned long *length = NULL;
+  unsigned long long h = HASH_SEED;
+  unsigned long k;
+  mlsize_t i, m;
+  long c;
 
-  row = mysql_fetch_row(res);
+  if (!res)
+    mysqlfailwith("Mysql.Index.lookup: result did not return fetchable data");
+  if (Wosize_val(keys) != ix->ncols)
+    caml_invalid_argument("Mysql.Index.lookup: wrong number of keys");
+  m = Is_block(cols)
+    ? projection(Some_val(cols), mysql_num_fields(res), "Mysql.Index.lookup: column out of range")
+    : mysql_num_fields(res);
+  for (i = 0; i < ix->ncols; i++)
+    h = hash_bytes(h, String_val(Field(keys, i)), caml_string_length(Field(keys, i)));
+
+  /* probing goes through result_fetch, which moves both the cursor and
+   * the current row (that of Cell and mysql_fetch_lengths): both are
+   * restored, the cells of the row found and their lengths being kept
+   * aside first
+   */
+  lengths = caml_alloc_string(m * sizeof(unsigned long));
+  cells = caml_alloc_string(m * sizeof(char*));
+  result_mark(r, &mark);
+  for (k = h & ix->mask; ix->slots[k].row; k = (k + 1) & ix->mask)
+  {
+    if (ix->slots[k].hash != h)
+      continue;
+    result_seek(r, ix->slots[k].row);
+    row = result_fetch(r);
+    length = result_lengths(r);
+    if (row_has_key(ix, row, length, keys))
+      break;
+    row = NULL;
+  }
+  if (row)
+    for (i = 0; i < m; i++)
+    {
+      c = Is_block(cols) ? Long_val(Field(Some_val(cols), i)) : (long)i;
+      ((unsigned long*)Bytes_val(lengths))[i] = length[c];
+      ((char**)Bytes_val(cells))[i] = row[c];
+    }
+  result_restore(r, &mark);
   if (!row)
     CAMLreturn(Val_none);
 
-  /* create Some([| f1; f2; .. ;fn |]) */
-
-  length = mysql_fetch_lengths(res);      /* length[] */
-  fields = caml_alloc_tuple(n);                    /* array */
-  for (i=0;i<n;i++) {
-    s = val_str_option(row[i], length[i]);
+  fields = caml_alloc_tuple(m);
+  for (i = 0; i < m; i++) {
+    s = val_str_option(((char**)Bytes_val(cells))[i], ((unsigned long*)Bytes_val(lengths))[i]);
     Store_field(fields, i, s);
   }
-
   CAMLreturn(Val_some(fields));
 }
 
+/*
+ * db_decode_rows -- decodes up to max rows of a result in one call (see
+ * Mysql.Row).  The plan is a Mysql.Row.plan: cells (kind, column
+ * position), pairs, and functions to apply; each row becomes the value it
+ * describes.  Returns an empty array at the end of the result.
+ */
+
+#define KIND_INT 0
+#define KIND_INT64 1
+#define KIND_FLOAT 2
+#define KIND_STRING 3
+#define KIND_NULLABLE 4
+
+/* the constructors of Mysql.Row.plan */
+#define PLAN_CELL 0
+#define PLAN_CELL_NULL 1
+#define PLAN_BOTH 2
+#define PLAN_APPLY 3
+
+/* runtime primitive behind array literals: an array of boxed floats
+ * becomes a float array when the runtime has those, as with Array.make
+ */
+CAMLextern value caml_make_array(value);
+
+static value
+decode_cell(const char *s, unsigned long len, int kind, long pos)
+{
+  long long n;
+  double d;
+  value v;
+
+  if (!s)
+  {
+    if (kind & KIND_NULLABLE)
+      return Val_none;
+    mysqlfailmsg("Mysql.Row: column %ld is NULL", pos);
+  }
+  switch (kind & ~KIND_NULLABLE)
+  {
+    case KIND_INT:
+    case KIND_INT64:
+      if (!parse_integer(s, len, &n))
+        mysqlfailmsg("Mysql.Row: column %ld is not an integer", pos);
+      if ((kind & ~KIND_NULLABLE) == KIND_INT && (n < Min_long || n > Max_long))
+        mysqlfailmsg("Mysql.Row: column %ld does not fit in an int", pos);
+      v = (kind & ~KIND_NULLABLE) == KIND_INT ? Val_long(n) : caml_copy_int64(n);
+      break;
+    case KIND_FLOAT:
+      if (!parse_float(s, len, &d))
+        mysqlfailmsg("Mysql.Row: column %ld is not a number", pos);
+      v = caml_copy_double(d);
+      break;
+    default:
+      v = caml_alloc_string(len);
+      memcpy((char*)String_val(v), s, len);
+  }
+  return (kind & KIND_NULLABLE) ? Val_some(v) : v;
+}
+
+static void
+check_plan(value plan, unsigned int n)
+{
+  switch (Tag_val(plan))
+  {
+    case PLAN_CELL:
+    case PLAN_CELL_NULL:
+      if (Long_val(Field(plan, 1)) < 0 || Long_val(Field(plan, 1)) >= (long)n)
+        caml_invalid_argument("Mysql.Row: column out of range");
+      break;
+    case PLAN_BOTH:
+      check_plan(Field(plan, 0), n);
+      check_plan(Field(plan, 1), n);
+      break;
+    default:
+      check_plan(Field(plan, 0), n);
+  }
+}
+
+static value
+decode_plan(value plan, MYSQL_ROW r, const unsigned long *length)
+{
+  CAMLparam1(plan);
+  CAMLlocal3(a, b, v);
+  long pos;
+
+  switch (Tag_val(plan))
+  {
+    case PLAN_CELL:
+    case PLAN_CELL_NULL:
+      pos = Long_val(Field(plan, 1));
+      v = decode_cell(r[pos], length[pos],
+                      Int_val(Field(plan, 0)) | (Tag_val(plan) == PLAN_CELL_NULL ? KIND_NULLABLE : 0),
+                      pos);
+      break;
+    case PLAN_BOTH:
+      a = decode_plan(Field(plan, 0), r, length);
+      b = decode_plan(Field(plan, 1), r, length);
+      v = caml_alloc_small(2, 0);
+      Field(v, 0) = a;
+      Field(v, 1) = b;
+      break;
+    default:
+      a = decode_plan(Field(plan, 0), r, length);
+      v = caml_callback(Field(plan, 1), a);
+  }
+  CAMLreturn(v);
+}
+
 EXTERNAL value
-db_to_row(value result, value offset)
+db_decode_rows(value result, value plan, value v_max)
 {
-  int64_t off = Int64_val(offset);
-  MYSQL_RES *res;
+  CAMLparam3(result, plan, v_max);
+  CAMLlocal3(rows, v, exact);
+  MYSQL_RES *res = RESval(result);
+  MYSQL_ROW r;
+  long i, count = 0, max = Long_val(v_max);
 
-  res = RESval(result);
   if (!res)
-    mysqlfailwith("Mysql.to_row: result did not return fetchable data");
+    mysqlfailwith("Mysql.Row: result did not return fetchable data");
+  if (max <= 0)                 /* [||] is the end of the result */
+    caml_invalid_argument("Mysql.Row.fetch: count");
+  check_plan(plan, mysql_num_fields(res));
+  if ((my_ulonglong)max > result_rows(RESULTval(result)))
+    max = (long)result_rows(RESULTval(result));
+  if (max <= 0)
+    CAMLreturn(Atom(0));
+
+  rows = caml_alloc(max, 0);
+  while (count < max && (r = result_fetch(RESULTval(result))) != NULL)
+  {
+    v = decode_plan(plan, r, result_lengths(RESULTval(result)));
+    Store_field(rows, count, v);
+    count++;
+  }
+  if (count == 0)
+    CAMLreturn(Atom(0));
+  if (count < max)
+  {
+    exact = caml_alloc(count, 0);
+    for (i = 0; i < count; i++)
+      Store_field(exact, i, Field(rows, i));
+    rows = exact;
+  }
+  CAMLreturn(caml_make_array(rows));
+}
 
-  if (off < 0 || off > (int64_t)mysql_num_rows(res)-1)
-    caml_invalid_argument("Mysql.to_row: offset out of range");
+/*
+ * db_fetch_block -- copies up to k rows of a result into a
+ * Mysql.Block.t: the bytes of all cells into one buffer, and an (offset,
+ * length) pair per cell into an int array, the length being -1 for NULL.
+ * Only the columns at the positions in cols are copied when given.  The
+ * buffers of the block are reused when large enough.  Returns false at
+ * the end of the result.
+ */
 
-  mysql_data_seek(res, off);
+#define Block_data 0
+#define Block_cells 1
+#define Block_rows 2
+#define Block_cols 3
 
-  return Val_unit;
+static void
+block_reserve(value block, mlsize_t bytes, mlsize_t cells)
+{
+  CAMLparam1(block);
+  CAMLlocal1(v);
+  mlsize_t cap;
+
+  cap = caml_string_length(Field(block, Block_data));
+  if (cap < bytes)
+  {
+    v = caml_alloc_string(2 * cap > bytes ? 2 * cap : bytes);
+    Store_field(block, Block_data, v);
+  }
+  cap = Wosize_val(Field(block, Block_cells));
+  if (cap < cells)
+  {
+    v = caml_alloc(2 * cap > cells ? 2 * cap : cells, 0);
+    Store_field(block, Block_cells, v);
+  }
+  CAMLreturn0;
+}
+
+#define Column(cols, i) (Is_block(cols) ? Long_val(Field(Some_val(cols), i)) : (long)(i))
+
+EXTERNAL value
+db_fetch_block(value result, value block, value v_k, value cols)
+{
+  CAMLparam4(result, block, v_k, cols);
+  MYSQL_RES *res = RESval(result);
+  struct result *rs = RESULTval(result);
+  row_pos start;
+  MYSQL_ROW row;
+  unsigned long *length;
+  mlsize_t i, n;
+  long k = Long_val(v_k), rows = 0, r, c;
+  mlsize_t bytes = 0, off = 0, j;
+  unsigned char *data;
+  value cells;
+
+  if (!res)
+    mysqlfailwith("Mysql.Block.fetch: result did not return fetchable data");
+  if (k <= 0)                   /* false is the end of the result */
+    caml_invalid_argument("Mysql.Block.fill: count");
+  n = mysql_num_fields(res);
+  if (Is_block(cols))
+    n = projection(Some_val(cols), n, "Mysql.Block.fill: column out of range");
+
+  /* size the block, then copy */
+  start = result_tell(rs);
+  while (rows < k && (row = result_fetch(rs)) != NULL)
+  {
+    length = result_lengths(rs);
+    for (i = 0; i < n; i++)
+      if (row[Column(cols, i)])
+        bytes += length[Column(cols, i)];
+    rows++;
+  }
+  result_seek(rs, start);
+  block_reserve(block, bytes, 2 * rows * n);
+
+  data = Bytes_val(Field(block, Block_data));
+  cells = Field(block, Block_cells);
+  for (r = 0; r < rows; r++)
+  {
+    row = result_fetch(rs);
+    length = result_lengths(rs);
+    for (i = 0; i < n; i++)
+    {
+      c = Column(cols, i);
+      j = 2 * (r * n + i);
+      Field(cells, j) = Val_long(off);
+      if (row[c])
+      {
+        memcpy(data + off, row[c], length[c]);
+        Field(cells, j + 1) = Val_long(length[c]);
+        off += length[c];
+      }
+      else
+        Field(cells, j + 1) = Val_long(-1);
+    }
+  }
+  Field(block, Block_rows) = Val_long(rows);
+  Field(block, Block_cols) = Val_long(n);
+  CAMLreturn(Val_bool(rows > 0));
+}
+
+/*
+ * Row offset index of a result (Mysql.Parallel): the rows can then be
+ * decoded by position, from several domains at once, without going
+ * through the cursor of the result.
+ */
+
+/* the rows of a result with their lengths, read once in the calling
+ * domain so that decoding them elsewhere only reads this and the row data
+ */
+
+struct row_index {
+  my_ulonglong count;
+  unsigned int ncols;
+  MYSQL_ROW *rows;
+  unsigned long *lengths;       /* ncols per row */
+  char **cells;                 /* the rows of a spill, ncols per row */
+};
+
+#define ROWINDEXval(x) (*(struct row_index**)Data_custom_val(x))
+
+static void
+row_index_finalize(value v)
+{
+  struct row_index *ix = ROWINDEXval(v);
+
+  if (ix)
+  {
+    free(ix->rows);
+    free(ix->lengths);
+    free(ix->cells);
+    free(ix);
+  }
+}
+
+struct custom_operations row_index_ops = {
+  "Mysql Row Index",
+  row_index_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+EXTERNAL value
+db_row_index(value result)
+{
+  CAMLparam1(result);
+  CAMLlocal1(v);
+  MYSQL_RES *res = RESval(result);
+  struct spill *sp = SPILLval(result);
+  struct result_mark mark;
+  MYSQL_ROW row;
+  unsigned long *length;
+  struct row_index *ix;
+  my_ulonglong i, cells;
+
+  if (!res)
+    mysqlfailwith("Mysql.Parallel: result did not return fetchable data");
+  ix = calloc(1, sizeof *ix);
+  if (!ix)
+    caml_raise_out_of_memory();
+  ix->count = result_rows(RESULTval(result));
+  ix->ncols = mysql_num_fields(res);
+  cells = ix->count && ix->ncols ? ix->count * ix->ncols : 1;
+  ix->rows = malloc((ix->count ? ix->count : 1) * sizeof(MYSQL_ROW));
+  ix->lengths = malloc(cells * sizeof(unsigned long));
+  if (sp)
+    ix->cells = malloc(cells * sizeof(char*));
+  if (!ix->rows || !ix->lengths || (sp && !ix->cells))
+  {
+    free(ix->rows);
+    free(ix->lengths);
+    free(ix->cells);
+    free(ix);
+    caml_raise_out_of_memory();
+  }
+
+  if (sp)                       /* decoded in place, the cursor is not used */
+    for (i = 0; i < ix->count; i++)
+    {
+      ix->rows[i] = ix->cells + i * ix->ncols;
+      spill_row(sp, i, ix->rows[i], ix->lengths + i * ix->ncols);
+    }
+  else
+  {
+    /* the cursor and the current row are restored, as by Index.lookup */
+    result_mark(RESULTval(result), &mark);
+    mysql_data_seek(res, 0);
+    for (i = 0; i < ix->count && (row = mysql_fetch_row(res)) != NULL; i++)
+    {
+      length = mysql_fetch_lengths(res);
+      ix->rows[i] = row;
+      memcpy(ix->lengths + i * ix->ncols, length, ix->ncols * sizeof(unsigned long));
+    }
+    ix->count = i;
+    result_restore(RESULTval(result), &mark);
+  }
+
+  v = caml_alloc_custom(&row_index_ops, sizeof(struct row_index*), 0, 1);
+  ROWINDEXval(v) = ix;
+  CAMLreturn(v);
+}
+
+/*
+ * db_decode_slice -- like db_decode_rows, for the rows from first to
+ * last - 1 of the row index.  Reentrant: only the index and the row data
+ * are read.
+ */
+
+EXTERNAL value
+db_decode_slice(value result, value index, value plan, value v_first, value v_last)
+{
+  CAMLparam5(result, index, plan, v_first, v_last);
+  CAMLlocal2(rows, v);
+  MYSQL_RES *res = RESval(result);
+  struct row_index *ix = ROWINDEXval(index);
+  unsigned int n;
+  long i, first = Long_val(v_first), last = Long_val(v_last);
+
+  if (!res)
+    mysqlfailwith("Mysql.Parallel: result did not return fetchable data");
+  n = mysql_num_fields(res);
+  if (first < 0 || last > (long)ix->count || first > last)
+    caml_invalid_argument("Mysql.Parallel: rows out of range");
+  check_plan(plan, n);
+  if (first == last)
+    CAMLreturn(Atom(0));
+
+  rows = caml_alloc(last - first, 0);
+  for (i = first; i < last; i++)
+  {
+    v = decode_plan(plan, ix->rows[i], ix->lengths + i * ix->ncols);
+    Store_field(rows, i - first, v);
+  }
+  CAMLreturn(caml_make_array(rows));
 }
 
 /*
@@ -604,31 +2721,171 @@ db_real_escape(value dbd, value str)
    * */
   esclen = mysql_real_escape_string(mysql,buf,s,len);
 
-  res = caml_alloc_string(esclen);
-  memcpy(String_val(res), buf, esclen);
-  caml_stat_free(buf);
+  res = caml_alloc_string(esclen);
+  memcpy(String_val(res), buf, esclen);
+  caml_stat_free(buf);
+
+  CAMLreturn(res);
+}
+
+EXTERNAL value
+db_set_charset(value dbd, value str)
+{
+  CAMLparam2(dbd, str);
+  char *s;
+  MYSQL *mysql;
+  struct session *st;
+  int res;
+
+  mysql = check_db(dbd, "set_charset");
+  st = session_of(dbd);
+  if (st->charset && 0 == strcmp(st->charset, String_val(str)))
+    CAMLreturn(Val_unit);
+
+  s = strdup(String_val(str));
+  caml_enter_blocking_section();
+  res = mysql_set_character_set(mysql,s);
+  caml_leave_blocking_section();
+
+  st = session_of(dbd);
+  if (res)
+  {
+    free(s);
+    session_set(&st->charset, NULL, 0);
+    mysqlfailmsg("Mysql.set_charset : %s",mysql_error(mysql));
+  }
+  free(st->charset);
+  st->charset = s;
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * db_set_session_vars -- sets the given session variables with a single
+ * SET statement, leaving out those known to have the value already.
+ */
+
+EXTERNAL value
+db_set_session_vars(value dbd, value vars)
+{
+  CAMLparam2(dbd, vars);
+  CAMLlocal2(l, v);
+  MYSQL *mysql = check_db(dbd, "set_session_vars");
+  struct session *st = session_of(dbd);
+  struct session_var *known;
+  size_t len = 0, n;
+  char *sql, *p;
+  int ret;
+
+  for (l = vars; l != Val_emptylist; l = Field(l, 1))
+  {
+    v = Field(l, 0);
+    known = session_find_var(st, String_val(Field(v, 0)));
+    if (!known || 0 != strcmp(known->value, String_val(Field(v, 1))))
+      len += caml_string_length(Field(v, 0)) + caml_string_length(Field(v, 1)) + 13;
+  }
+  if (len == 0)
+    CAMLreturn(Val_unit);
+
+  p = sql = malloc(len + 3);
+  if (!sql)
+    caml_raise_out_of_memory();
+  memcpy(p, "SET", 3);
+  p += 3;
+  for (l = vars; l != Val_emptylist; l = Field(l, 1))
+  {
+    v = Field(l, 0);
+    known = session_find_var(st, String_val(Field(v, 0)));
+    if (known && 0 == strcmp(known->value, String_val(Field(v, 1))))
+      continue;
+    if (p != sql + 3)
+      *p++ = ',';
+    memcpy(p, " SESSION ", 9);
+    p += 9;
+    n = caml_string_length(Field(v, 0));
+    memcpy(p, String_val(Field(v, 0)), n);
+    p += n;
+    memcpy(p, " = ", 3);
+    p += 3;
+    n = caml_string_length(Field(v, 1));
+    memcpy(p, String_val(Field(v, 1)), n);
+    p += n;
+  }
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, p - sql);
+  caml_leave_blocking_section();
+
+  free(sql);
+  st = session_of(dbd);
+  if (ret)
+    mysqlfailmsg("Mysql.set_session_vars: %s", mysql_error(mysql));
+
+  session_track(mysql, st);
+  for (l = vars; l != Val_emptylist; l = Field(l, 1))
+  {
+    v = Field(l, 0);
+    session_var_changed(st, String_val(Field(v, 0)), caml_string_length(Field(v, 0)));
+    session_put_var(st, String_val(Field(v, 0)), caml_string_length(Field(v, 0)),
+                    String_val(Field(v, 1)), caml_string_length(Field(v, 1)));
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * Transactions
+ */
+
+EXTERNAL value
+db_autocommit(value dbd, value v_mode)
+{
+  CAMLparam2(dbd, v_mode);
+  MYSQL *mysql = check_db(dbd, "autocommit");
+  my_bool mode = Bool_val(v_mode);
+  my_bool ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_autocommit(mysql, mode);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.autocommit: %s", mysql_error(mysql));
+
+  CAMLreturn(Val_unit);
+}
+
+EXTERNAL value
+db_commit(value dbd)
+{
+  CAMLparam1(dbd);
+  MYSQL *mysql = check_db(dbd, "commit");
+  my_bool ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_commit(mysql);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.commit: %s", mysql_error(mysql));
+  session_track(mysql, session_of(dbd));
 
-  CAMLreturn(res);
+  CAMLreturn(Val_unit);
 }
 
 EXTERNAL value
-db_set_charset(value dbd, value str)
+db_rollback(value dbd)
 {
-  CAMLparam2(dbd, str);
-  char *s;
-  MYSQL *mysql;
-  int res;
-
-  mysql = check_db(dbd, "set_charset");
+  CAMLparam1(dbd);
+  MYSQL *mysql = check_db(dbd, "rollback");
+  my_bool ret;
 
-  s = strdup(String_val(str));
   caml_enter_blocking_section();
-  res = mysql_set_character_set(mysql,s);
-  free(s);
+  ret = mysql_rollback(mysql);
   caml_leave_blocking_section();
 
-  if (res)
-    mysqlfailmsg("Mysql.set_charset : %s",mysql_error(mysql));
+  if (ret)
+    mysqlfailmsg("Mysql.rollback: %s", mysql_error(mysql));
 
   CAMLreturn(Val_unit);
 }
@@ -648,7 +2905,7 @@ db_size(value result)
   if (!res)
     size = 0;
   else
-    size = (int64_t)mysql_num_rows(res);
+    size = (int64_t)result_rows(RESULTval(result));
 
   CAMLreturn(caml_copy_int64(size));
 }
@@ -710,6 +2967,75 @@ db_proto_info(value dbd) {
   return Val_long(info);
 }
 
+/* the largest packet the client accepts on dbd */
+
+EXTERNAL value
+db_max_allowed_packet(value dbd) {
+  MYSQL *mysql = check_db(dbd, "auto_tune");
+#if HAVE_DECL_MYSQL_GET_OPTION && HAVE_DECL_MYSQL_OPT_MAX_ALLOWED_PACKET
+  unsigned long n = 0;
+
+  if (0 == mysql_get_option(mysql, MYSQL_OPT_MAX_ALLOWED_PACKET, &n) && n > 0)
+    return Val_long(n);
+#else
+  (void)mysql;
+#endif
+  return Val_long(1L << 30);    /* the client library default */
+}
+
+EXTERNAL value
+db_max_row_width(value dbd) {
+  return Val_long(DBDsession(dbd) ? DBDsession(dbd)->max_row : 0);
+}
+
+EXTERNAL value
+db_thread_id(value dbd) {
+  long id = (long)mysql_thread_id(check_db(dbd, "thread_id"));
+  return Val_long(id);
+}
+
+/*
+ * db_last_gtids -- GTIDs reported by the server in the OK packet of the
+ * last statement (session_track_gtids must be enabled on the server).
+ */
+
+EXTERNAL value
+db_last_gtids(value dbd) {
+  CAMLparam1(dbd);
+  MYSQL *mysql = check_db(dbd, "last_gtids");
+#if HAVE_DECL_MYSQL_SESSION_TRACK_GET_FIRST
+  const char *data;
+  size_t length;
+
+  if (0 == mysql_session_track_get_first(mysql, SESSION_TRACK_GTIDS, &data, &length))
+    CAMLreturn(val_str_option(data, length));
+#else
+  (void)mysql;
+#endif
+  CAMLreturn(Val_none);
+}
+
+/*
+ * db_collect_gtids -- the GTIDs collected from session tracking since the
+ * last call, and whether to go on collecting.  Statements run with Prepared
+ * are not seen, only commits and statements run on the connection.
+ */
+
+EXTERNAL value
+db_collect_gtids(value dbd, value on) {
+  CAMLparam2(dbd, on);
+  CAMLlocal1(r);
+  struct session *st;
+
+  check_db(dbd, "collect_gtids");
+  st = DBDsession(dbd);
+  r = st->gtids ? val_str_option(st->gtids, strlen(st->gtids)) : Val_none;
+  free(st->gtids);
+  st->gtids = NULL;
+  st->collect_gtids = Bool_val(on);
+  CAMLreturn(r);
+}
+
 
 /*
  * type2dbty - maps column types to dbty values which describe the
@@ -865,6 +3191,356 @@ db_fetch_fields(value result) {
   CAMLreturn(Val_some(fields));
 }
 
+/*
+ * Mysql.Mux -- one thread drives the statements of many connections.  A
+ * slot per connection runs mysql_real_query_nonblocking and then
+ * mysql_store_result_nonblocking as its socket becomes readable; db_mux_wait
+ * waits on all of them with epoll (one-shot, re-armed while a slot is not
+ * done) and on a pipe that db_mux_wake writes to.
+ */
+
+enum { MUX_IDLE, MUX_QUERY, MUX_STORE, MUX_DONE };
+
+struct mux_slot {
+  MYSQL *mysql;
+  char *sql;
+  size_t len;
+  int phase;
+  int failed;
+  MYSQL_RES *res;
+};
+
+struct mux {
+  int epfd;                     /* -1 once closed */
+  int wake[2];
+  int n;
+  struct mux_slot *slots;
+  int *ready;                   /* n done slots found by db_mux_wait */
+};
+
+#define MUXval(x) (*(struct mux**)Data_custom_val(x))
+
+static void
+mux_free(struct mux *m)
+{
+  int i;
+
+  if (!m)
+    return;
+#if ML_MUX
+  if (m->epfd >= 0)
+  {
+    close(m->epfd);
+    close(m->wake[0]);
+    close(m->wake[1]);
+  }
+#endif
+  for (i = 0; i < m->n; i++)
+  {
+    free(m->slots[i].sql);
+    if (m->slots[i].res)
+      mysql_free_result(m->slots[i].res);
+  }
+  free(m->slots);
+  free(m->ready);
+  free(m);
+}
+
+static void
+mux_finalize(value v)
+{
+  mux_free(MUXval(v));
+}
+
+struct custom_operations mux_ops = {
+  "Mysql Mux",
+  mux_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+};
+
+static struct mux*
+check_mux(value v, const char *fun)
+{
+  struct mux *m = MUXval(v);
+
+  if (!m || m->epfd < 0)
+    mysqlfailmsg("Mysql.Mux.%s: multiplexer is closed", fun);
+  return m;
+}
+
+EXTERNAL value
+db_mux_available(value unit)
+{
+#if ML_MUX
+  return Val_true;
+#else
+  return Val_false;
+#endif
+}
+
+EXTERNAL value
+db_connect_nonblocking(value options, value args)
+{
+  return connect_gen(options, args, 1);
+}
+
+#if ML_MUX
+
+/* mux_step -- advance slot s as far as its socket allows, returns whether
+ * it is done.  Runs without the runtime lock.
+ */
+
+static int
+mux_step(struct mux_slot *s)
+{
+  enum net_async_status status;
+
+  if (s->phase == MUX_QUERY)
+  {
+    status = mysql_real_query_nonblocking(s->mysql, s->sql, s->len);
+    if (status == NET_ASYNC_NOT_READY)
+      return 0;
+    s->phase = status == NET_ASYNC_ERROR ? MUX_DONE : MUX_STORE;
+    s->failed = status == NET_ASYNC_ERROR;
+  }
+  if (s->phase == MUX_STORE)
+  {
+    status = mysql_store_result_nonblocking(s->mysql, &s->res);
+    if (status == NET_ASYNC_NOT_READY)
+      return 0;
+    s->phase = MUX_DONE;
+    s->failed = status == NET_ASYNC_ERROR || (!s->res && mysql_errno(s->mysql));
+  }
+  return s->phase == MUX_DONE;
+}
+
+static void
+mux_arm(struct mux *m, int i)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u32 = i;
+  epoll_ctl(m->epfd, EPOLL_CTL_MOD, conn_socket(m->slots[i].mysql), &ev);
+}
+
+#endif
+
+/* db_mux_create -- a multiplexer for the connections conns */
+
+EXTERNAL value
+db_mux_create(value conns)
+{
+  CAMLparam1(conns);
+  CAMLlocal1(res);
+#if ML_MUX
+  struct mux *m;
+  struct epoll_event ev;
+  int i, n = Wosize_val(conns);
+
+  for (i = 0; i < n; i++)
+    check_db(Field(conns, i), "Mux.create");
+  res = caml_alloc_custom(&mux_ops, sizeof(struct mux*), 0, 1);
+  MUXval(res) = NULL;
+  m = calloc(1, sizeof *m);
+  if (!m)
+    caml_raise_out_of_memory();
+  m->epfd = -1;
+  m->slots = calloc(n > 0 ? n : 1, sizeof *m->slots);
+  m->ready = calloc(n > 0 ? n : 1, sizeof *m->ready);
+  if (!m->slots || !m->ready)
+  {
+    mux_free(m);
+    caml_raise_out_of_memory();
+  }
+  m->n = n;
+  MUXval(res) = m;
+
+  if (pipe(m->wake) != 0)
+    mysqlfailmsg("Mysql.Mux.create: %s", strerror(errno));
+  fcntl(m->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(m->wake[1], F_SETFL, O_NONBLOCK);
+  if ((m->epfd = epoll_create(n + 1)) < 0)
+  {
+    close(m->wake[0]);
+    close(m->wake[1]);
+    mysqlfailmsg("Mysql.Mux.create: %s", strerror(errno));
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = n;              /* the wake pipe */
+  epoll_ctl(m->epfd, EPOLL_CTL_ADD, m->wake[0], &ev);
+  for (i = 0; i < n; i++)
+  {
+    m->slots[i].mysql = DBDmysql(Field(conns, i));
+    ev.events = EPOLLONESHOT;   /* disarmed until a statement waits */
+    ev.data.u32 = i;
+    if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, conn_socket(m->slots[i].mysql), &ev) != 0)
+      mysqlfailmsg("Mysql.Mux.create: %s", strerror(errno));
+  }
+#else
+  mysqlfailwith("Mysql.Mux: not supported by the client library");
+#endif
+  CAMLreturn(res);
+}
+
+/* db_mux_start -- starts sql on the idle slot i */
+
+EXTERNAL value
+db_mux_start(value v_mux, value v_i, value v_sql)
+{
+  CAMLparam3(v_mux, v_i, v_sql);
+#if ML_MUX
+  struct mux *m = check_mux(v_mux, "start");
+  long i = Long_val(v_i);
+  struct mux_slot *s;
+
+  if (i < 0 || i >= m->n || m->slots[i].phase != MUX_IDLE)
+    caml_invalid_argument("Mysql.Mux.start: slot");
+  s = &m->slots[i];
+  s->len = caml_string_length(v_sql);
+  if ((s->sql = malloc(s->len + 1)) == NULL)
+    caml_raise_out_of_memory();
+  memcpy(s->sql, String_val(v_sql), s->len + 1);
+  s->phase = MUX_QUERY;
+  s->failed = 0;
+  s->res = NULL;
+  /* the first step only sends the statement, the reply comes later */
+  if (!mux_step(s))
+    mux_arm(m, i);
+#endif
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * db_mux_wait -- waits up to timeout seconds for slots to become done and
+ * returns them.  The epoll set only waits for replies, so a slot still
+ * sending its statement would not be woken: the slots in MUX_QUERY are
+ * stepped on every call, the wait being cut to MUX_SEND_MS while there are
+ * some.  Without events in that time every running slot is stepped once.
+ */
+
+#define MUX_SEND_MS 10
+
+EXTERNAL value
+db_mux_wait(value v_mux, value v_timeout)
+{
+  CAMLparam2(v_mux, v_timeout);
+  CAMLlocal1(done);
+#if ML_MUX
+  struct mux *m = check_mux(v_mux, "wait");
+  int timeout = (int)(Double_val(v_timeout) * 1000.);
+  struct epoll_event events[64];
+  int i, k, n, count = 0;
+  char buf[64];
+
+  for (i = 0; i < m->n; i++)
+    if (m->slots[i].phase == MUX_DONE)
+      timeout = 0;              /* unclaimed results, do not sleep */
+    else if (m->slots[i].phase == MUX_QUERY && (timeout < 0 || timeout > MUX_SEND_MS))
+      timeout = MUX_SEND_MS;
+
+  caml_enter_blocking_section();
+  n = epoll_wait(m->epfd, events, 64, timeout);
+  for (k = 0; k < n; k++)
+  {
+    i = events[k].data.u32;
+    if (i == m->n)
+      while (read(m->wake[0], buf, sizeof buf) > 0)
+        ;
+    else if (m->slots[i].phase != MUX_IDLE && m->slots[i].phase != MUX_DONE
+             && !mux_step(&m->slots[i]))
+      mux_arm(m, i);
+  }
+  for (i = 0; i < m->n; i++)
+    if (m->slots[i].phase == MUX_QUERY
+        || (n == 0 && m->slots[i].phase == MUX_STORE))
+      if (!mux_step(&m->slots[i]))
+        mux_arm(m, i);
+  for (i = 0; i < m->n; i++)
+    if (m->slots[i].phase == MUX_DONE)
+      m->ready[count++] = i;
+  caml_leave_blocking_section();
+
+  done = caml_alloc_tuple(count);
+  for (i = 0; i < count; i++)
+    Field(done, i) = Val_int(m->ready[i]);
+#else
+  done = Atom(0);
+#endif
+  CAMLreturn(done);
+}
+
+/*
+ * db_mux_result -- takes the result of the done slot i, whose connection
+ * is dbd, and makes it idle again.
+ */
+
+EXTERNAL value
+db_mux_result(value v_mux, value v_i, value v_dbd)
+{
+  CAMLparam3(v_mux, v_i, v_dbd);
+  CAMLlocal1(res);
+#if ML_MUX
+  struct mux *m = check_mux(v_mux, "result");
+  long i = Long_val(v_i);
+  struct mux_slot *s;
+  struct session *st;
+
+  if (i < 0 || i >= m->n || m->slots[i].phase != MUX_DONE)
+    caml_invalid_argument("Mysql.Mux.result: slot");
+  s = &m->slots[i];
+  st = session_of(v_dbd);
+  session_exec(st, s->sql, s->len);
+  free(s->sql);
+  s->sql = NULL;
+  s->phase = MUX_IDLE;
+  if (s->failed)
+    mysqlfailmsg("Mysql.Mux: %s", mysql_error(s->mysql));
+
+  res = caml_alloc_custom(&res_ops, sizeof(struct result), 0, 1);
+  SPILLval(res) = NULL;
+  RESval(res) = s->res;
+  s->res = NULL;
+  session_track(s->mysql, st);
+  session_record(st, RESval(res));
+#endif
+  CAMLreturn(res);
+}
+
+/* db_mux_wake -- makes a db_mux_wait in another thread return */
+
+EXTERNAL value
+db_mux_wake(value v_mux)
+{
+#if ML_MUX
+  struct mux *m = check_mux(v_mux, "wake");
+  char c = 0;
+
+  if (write(m->wake[1], &c, 1) < 0)
+  {
+    /* the pipe is full: a wake up is pending anyway */
+  }
+#endif
+  return Val_unit;
+}
+
+/* db_mux_close -- releases the epoll instance and slots, not the connections */
+
+EXTERNAL value
+db_mux_close(value v_mux)
+{
+  mux_free(MUXval(v_mux));
+  MUXval(v_mux) = NULL;
+  return Val_unit;
+}
+
 static void
 check_stmt(MYSQL_STMT* stmt, char *fun)
 {
@@ -992,6 +3668,32 @@ void set_param_string(row_t *r, value v, int index)
   memcpy(bind->buffer, String_val(v), len);
 }
 
+/* set_param_integer -- binds the decimal string v as a BIGINT, so that it
+ * compares exactly with integer columns; returns 0 when v is not one.
+ */
+
+static int
+set_param_integer(row_t *r, value v, int index, int is_unsigned)
+{
+  MYSQL_BIND* bind = &r->bind[index];
+  const char *s = String_val(v);
+  size_t len = caml_string_length(v);
+  unsigned long long n;
+  char *end;
+
+  if (len == 0 || isspace((unsigned char)s[0]) || (is_unsigned && s[0] == '-'))
+    return 0;
+  errno = 0;
+  n = is_unsigned ? strtoull(s, &end, 10) : (unsigned long long)strtoll(s, &end, 10);
+  if (errno || end != s + len)
+    return 0;
+  bind->buffer_type = MYSQL_TYPE_LONGLONG;
+  bind->is_unsigned = is_unsigned;
+  bind->buffer = malloc(sizeof n);
+  memcpy(bind->buffer, &n, sizeof n);
+  return 1;
+}
+
 void set_param_null(row_t *r, int index)
 {
   MYSQL_BIND* bind = &r->bind[index];
@@ -1068,11 +3770,16 @@ struct custom_operations stmt_result_ops = {
 #endif
 };
 
-value
-caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
+/* stmt_run -- binds the parameters and executes the statement.  kinds is
+ * Val_unit or an int array telling for each parameter whether it is bound
+ * as a string (0), a signed (1) or an unsigned (2) integer.
+ */
+
+static void
+stmt_run(value v_stmt, value v_params, int with_null, value kinds, const char *fun)
 {
-  CAMLparam2(v_stmt,v_params);
-  CAMLlocal2(res,v);
+  CAMLparam3(v_stmt,v_params,kinds);
+  CAMLlocal1(v);
   unsigned int i = 0;
   unsigned int len = Wosize_val(v_params);
   int err = 0;
@@ -1080,10 +3787,12 @@ caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
   MYSQL_STMT* stmt = STMTval(v_stmt);
   check_stmt(stmt,"execute");
   if (len != mysql_stmt_param_count(stmt))
-    mysqlfailmsg("Prepared.execute : Got %i parameters, but expected %i", len, mysql_stmt_param_count(stmt));
+    mysqlfailmsg("%s : Got %i parameters, but expected %i", fun, len, mysql_stmt_param_count(stmt));
+  if (kinds != Val_unit && Wosize_val(kinds) != len)
+    caml_invalid_argument("Prepared.execute: parameter kinds");
   row = create_row(stmt, len);
   if (!row)
-    mysqlfailwith("Prepared.execute : create_row for params");
+    mysqlfailmsg("%s : create_row for params", fun);
   for (i = 0; i < len; i++)
   {
     v = Field(v_params,i);
@@ -1092,7 +3801,8 @@ caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
         set_param_null(row, i);
       else
         set_param_string(row, Some_val(v), i);
-    else
+    else if (kinds == Val_unit || Int_val(Field(kinds, i)) == 0
+             || !set_param_integer(row, v, i, Int_val(Field(kinds, i)) == 2))
       set_param_string(row, v, i);
   }
   err = mysql_stmt_bind_param(stmt, row->bind);
@@ -1100,7 +3810,7 @@ caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
   {
     for (i = 0; i < len; i++) free(row->bind[i].buffer);
     destroy_row(row);
-    mysqlfailmsg("Prepared.execute : mysql_stmt_bind_param = %i",err);
+    mysqlfailmsg("%s : mysql_stmt_bind_param = %i", fun, err);
   }
   caml_enter_blocking_section();
   err = mysql_stmt_execute(stmt);
@@ -1111,8 +3821,22 @@ caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
 
   if (err)
   {
-    mysqlfailmsg("Prepared.execute : mysql_stmt_execute = %i, %s",err,mysql_stmt_error(stmt));
+    mysqlfailmsg("%s : mysql_stmt_execute = %i, %s", fun, err, mysql_stmt_error(stmt));
   }
+  CAMLreturn0;
+}
+
+value
+caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null, value kinds)
+{
+  CAMLparam3(v_stmt,v_params,kinds);
+  CAMLlocal1(res);
+  unsigned int i = 0;
+  unsigned int len;
+  row_t* row = NULL;
+  MYSQL_STMT* stmt = STMTval(v_stmt);
+
+  stmt_run(v_stmt, v_params, with_null, kinds, "Prepared.execute");
 
   len = mysql_stmt_field_count(stmt);
   row = create_row(stmt, len);
@@ -1137,12 +3861,53 @@ caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
 
 EXTERNAL value caml_mysql_stmt_execute(value v_stmt, value v_param)
 {
-  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 0);
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 0, Val_unit);
 }
 
 EXTERNAL value caml_mysql_stmt_execute_null(value v_stmt, value v_param)
 {
-  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 1);
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 1, Val_unit);
+}
+
+/* caml_mysql_stmt_execute_typed -- execute, binding integer parameters
+ * with integer types (Mysql.Scan keys)
+ */
+
+EXTERNAL value caml_mysql_stmt_execute_typed(value v_stmt, value v_param, value kinds)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 0, kinds);
+}
+
+/*
+ * caml_mysql_stmt_execute_dml -- executes a statement for its effect and
+ * returns the dml_info record without a result handle.  Rows the
+ * statement returns are discarded.
+ */
+
+static value
+stmt_execute_dml(value v_stmt, value v_params, int with_null)
+{
+  MYSQL_STMT* stmt = STMTval(v_stmt);
+
+  stmt_run(v_stmt, v_params, with_null, Val_unit, "Prepared.execute_dml");
+  if (mysql_stmt_field_count(stmt) > 0)
+  {
+    caml_enter_blocking_section();
+    mysql_stmt_free_result(stmt);
+    caml_leave_blocking_section();
+  }
+  return dml_info(stmt->mysql, mysql_stmt_affected_rows(stmt),
+                  mysql_stmt_insert_id(stmt));
+}
+
+EXTERNAL value caml_mysql_stmt_execute_dml(value v_stmt, value v_param)
+{
+  return stmt_execute_dml(v_stmt, v_param, 0);
+}
+
+EXTERNAL value caml_mysql_stmt_execute_dml_null(value v_stmt, value v_param)
+{
+  return stmt_execute_dml(v_stmt, v_param, 1);
 }
 
 EXTERNAL value
@@ -1166,6 +3931,68 @@ caml_mysql_stmt_fetch(value result)
   CAMLreturn(Val_some(arr));
 }
 
+/*
+ * caml_mysql_stmt_fetch_into -- fetches the next row into a block (see
+ * db_fetch_block), reusing its buffers.
+ */
+
+EXTERNAL value
+caml_mysql_stmt_fetch_into(value result, value block, value cols)
+{
+  CAMLparam3(result, block, cols);
+  mlsize_t i, n;
+  long c;
+  int res;
+  mlsize_t bytes = 0, off = 0;
+  row_t* r = ROWval(result);
+  MYSQL_BIND* bind;
+  value cells;
+
+  check_stmt(r->stmt,"fetch_into");
+  n = r->count;
+  if (Is_block(cols))
+    n = projection(Some_val(cols), r->count, "Mysql.Prepared.fetch_into: column out of range");
+  caml_enter_blocking_section();
+  res = mysql_stmt_fetch(r->stmt);
+  caml_leave_blocking_section();
+  if (0 != res && MYSQL_DATA_TRUNCATED != res)
+  {
+    Field(block, Block_rows) = Val_long(0);
+    CAMLreturn(Val_false);
+  }
+
+  for (i = 0; i < n; i++)
+    if (!r->is_null[Column(cols, i)])
+      bytes += r->length[Column(cols, i)];
+  block_reserve(block, bytes, 2 * n);
+
+  cells = Field(block, Block_cells);
+  for (i = 0; i < n; i++)
+  {
+    c = Column(cols, i);
+    Field(cells, 2 * i) = Val_long(off);
+    if (r->is_null[c])
+    {
+      Field(cells, 2 * i + 1) = Val_long(-1);
+      continue;
+    }
+    Field(cells, 2 * i + 1) = Val_long(r->length[c]);
+    if (r->length[c] > 0)
+    {
+      bind = &r->bind[c];
+      bind->buffer = Bytes_val(Field(block, Block_data)) + off;
+      bind->buffer_length = r->length[c];
+      mysql_stmt_fetch_column(r->stmt, bind, c, 0);
+      bind->buffer = 0; /* reset binding */
+      bind->buffer_length = 0;
+      off += r->length[c];
+    }
+  }
+  Field(block, Block_rows) = Val_long(1);
+  Field(block, Block_cols) = Val_long(n);
+  CAMLreturn(Val_true);
+}
+
 EXTERNAL value
 caml_mysql_stmt_affected(value stmt) 
 {
@@ -1197,7 +4024,8 @@ caml_mysql_stmt_result_metadata(value stmt)
     CAMLlocal1(res);
 
     check_stmt(STMTval(stmt), "result_metadata");
-    res = caml_alloc_custom(&res_ops, sizeof(MYSQL_RES*), 0, 1);
+    res = caml_alloc_custom(&res_ops, sizeof(struct result), 0, 1);
+    SPILLval(res) = NULL;
     RESval(res) = mysql_stmt_result_metadata(STMTval(stmt));
 
     CAMLreturn(res);